@@ -1,6 +1,7 @@
 #ifndef ASYNC_FILES_HH
 #define ASYNC_FILES_HH
 #include <filesystem>
+#include <cstdint>
 
 #ifndef __EMSCRIPTEN__
 #include <future>
@@ -10,34 +11,62 @@ namespace AsyncFiles
 {
     enum Operation
     {
-        Read, Write
+        // Read allocates the buffer, and Write deletes the one it's given.
+        // The others read into or write from memory the caller owns
+        Read, Write, ReadInto, WriteFrom, WriteAt
     };
 
     class FilePromise
     {
     public:
-        FilePromise(std::filesystem::path file, Operation op, char* data = nullptr, uint32_t isize = 0) {};
+        FilePromise(std::filesystem::path file, Operation op, char* data = nullptr, uint64_t isize = 0, uint64_t offset = 0) {};
+        virtual ~FilePromise() {};
         virtual bool isDone() const {return false;}
-        virtual char* get(uint32_t &size) {return nullptr;}
+
+        /**
+        Gets the data and the amount of bytes read or written, waiting for it if it's not done.
+        Throws if the file couldn't be read or written
+        */
+        virtual char* get(uint64_t &size) {return nullptr;}
         virtual void wait() {};
 
+        char* get(uint32_t &size)
+        {
+            uint64_t full_size;
+            char* data = get(full_size);
+            size = full_size;
+            return data;
+        }
+
     private:
 
     };
 
 #ifndef __EMSCRIPTEN__
 
+    /** What a finished operation gives back */
+    struct Result
+    {
+        char* data;
+        uint64_t size;
+    };
+
     class desktop_FilePromise : public FilePromise
     {
     public:
-        desktop_FilePromise(std::filesystem::path file, Operation op, char* data = nullptr, uint32_t isize = 0);
+        desktop_FilePromise(std::filesystem::path file, Operation op, char* data = nullptr, uint64_t isize = 0, uint64_t offset = 0);
         virtual bool isDone() const override;
-        virtual char* get(uint32_t &size) override;
+        virtual char* get(uint64_t &size) override;
         virtual void wait() override;
 
+        using FilePromise::get;
+
     private:
-        std::future<char*> promise;
-        uint32_t size;
+        std::future<Result> promise;
+
+        // The future can only be read once, so the result is kept
+        Result result;
+        bool has_result = false;
     };
 
 #else
@@ -45,14 +74,22 @@ namespace AsyncFiles
     class web_FilePromise : public FilePromise
     {
     public:
-        web_FilePromise(std::filesystem::path file, Operation op, char* data = nullptr, uint32_t isize = 0);
+        web_FilePromise(std::filesystem::path file, Operation op, char* data = nullptr, uint64_t isize = 0, uint64_t offset = 0);
         virtual bool isDone() const override;
-        virtual char* get(uint32_t &size) override;
+        virtual char* get(uint64_t &size) override;
         virtual void wait() override;
 
-        void setData(char* data, uint32_t size);
+        using FilePromise::get;
+
+        void setData(char* data, uint64_t size);
+
+        // Where a ranged read goes
+        Operation op;
+        char* dest;
+        uint64_t offset;
+        uint64_t length;
     private:
-        uint32_t size;
+        uint64_t size;
         bool done;
         char* data;
     };
@@ -62,11 +99,30 @@ namespace AsyncFiles
     /** Asyncrinously reads a binary file */
     FilePromise* read(std::filesystem::path filename);
 
-    /** Asyncrinously writes a binary file. Currently doesn't work in WASM */
+    /**
+    Asyncrinously reads length bytes from offset in a file straight into dest, e.g. a single file in an archive.
+    dest has to stay valid until it's done. get() returns dest, and how much was read, which is less than
+    length if the file ends first
+    */
+    FilePromise* read(std::filesystem::path filename, uint64_t offset, uint64_t length, char* dest);
+
+    /** Asyncrinously writes a binary file, and deletes data once it's written. Currently doesn't work in WASM */
     FilePromise* write(std::filesystem::path filename, char* data, uint32_t size);
 
+    /**
+    Asyncrinously writes a binary file from memory the caller owns, which has to stay valid until it's done.
+    Currently doesn't work in WASM
+    */
+    FilePromise* writeFrom(std::filesystem::path filename, const char* data, uint64_t size);
+
+    /**
+    Asyncrinously writes size bytes at offset in a file, leaving the rest of it as it is. The file is created if
+    it doesn't exist. data is owned by the caller, and has to stay valid until it's done. Currently doesn't work in WASM
+    */
+    FilePromise* writeAt(std::filesystem::path filename, uint64_t offset, const char* data, uint64_t size);
+
     void close(FilePromise* file);
 
 }
 
-#endif
\ No newline at end of file
+#endif
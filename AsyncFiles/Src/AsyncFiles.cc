@@ -1,4 +1,5 @@
 #include "AsyncFiles/AsyncFiles.hh"
+#include <algorithm>
 #include <cstring>
 #include <filesystem>
 #include <iostream>
@@ -10,62 +11,103 @@ using namespace AsyncFiles;
 #ifndef __EMSCRIPTEN__
 #include <fstream>
 #include <future>
+#include <memory>
+#include <stdexcept>
 
-char* doFileSystem(std::filesystem::path file, Operation op, char* data, uint32_t osize)
+Result doFileSystem(std::filesystem::path file, Operation op, char* data, uint64_t osize, uint64_t offset)
 {
-    if (op == Operation::Read) {
+    if (op == Operation::Read || op == Operation::ReadInto)
+    {
         std::ifstream infile;
         infile.open(file, std::ios::binary | std::ios::in);
-        infile.seekg(std::ios::end);
-        uint32_t size = infile.tellg();
-        infile.seekg(std::ios::beg);
-
-        auto output = new char[size];
-        infile.read(output, size);
-        osize = size;
+        if (!infile)
+        {
+            throw std::runtime_error("Error: Could not read " + file.string());
+        }
+
+        if (op == Operation::Read)
+        {
+            infile.seekg(0, std::ios::end);
+            osize = infile.tellg();
+            infile.seekg(0, std::ios::beg);
+
+            data = new char[osize];
+        }
+        else
+        {
+            infile.seekg(offset, std::ios::beg);
+        }
+
+        // A ranged read can go past the end of the file; only what's there is read
+        infile.read(data, osize);
+        uint64_t size = infile.gcount();
 
         infile.close();
 
-        return output;
+        return {data, size};
     }
     else
     {
-        std::ofstream infile;
-        infile.open(file, std::ios::binary | std::ios::out);
-        infile.write(data, osize);
-        infile.flush();
-        infile.close();
-        delete[] data;
-        return nullptr;
+        // Write takes ownership of the data
+        std::unique_ptr<char[]> owned(op == Operation::Write ? data : nullptr);
+
+        std::fstream outfile;
+        if (op == Operation::WriteAt)
+        {
+            // Opening for reading as well keeps what's already in the file, but only works if it exists
+            if (!std::filesystem::exists(file))
+            {
+                std::ofstream(file, std::ios::binary | std::ios::out);
+            }
+            outfile.open(file, std::ios::binary | std::ios::in | std::ios::out);
+            outfile.seekp(offset, std::ios::beg);
+        }
+        else
+        {
+            outfile.open(file, std::ios::binary | std::ios::out | std::ios::trunc);
+        }
+
+        outfile.write(data, osize);
+        outfile.flush();
+        outfile.close();
+
+        if (!outfile)
+        {
+            throw std::runtime_error("Error: Could not write " + file.string());
+        }
+
+        return {nullptr, osize};
     }
 }
 
-desktop_FilePromise::desktop_FilePromise(std::filesystem::path file, Operation op, char* data, uint32_t isize): FilePromise(file, op, data, isize)
+desktop_FilePromise::desktop_FilePromise(std::filesystem::path file, Operation op, char* data, uint64_t isize, uint64_t offset): FilePromise(file, op, data, isize, offset)
 {
-    if (op == Operation::Read)
-    {
-        promise = std::async(std::launch::async, doFileSystem, file, op, data, size);
-    }
-    else
-    {
-        promise = std::async(std::launch::async, doFileSystem, file, op, data, isize);
-    }
+    promise = std::async(std::launch::async, doFileSystem, file, op, data, isize, offset);
 }
 
 bool desktop_FilePromise::isDone() const
 {
-    return promise.valid();
+    return has_result || promise.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
 }
 
-char* desktop_FilePromise::get(uint32_t &size)
+char* desktop_FilePromise::get(uint64_t &size)
 {
-    size = this->size;
-    return promise.get();
+    if (!has_result)
+    {
+        result = promise.get();
+        has_result = true;
+    }
+
+    size = result.size;
+    return result.data;
 }
 
 void desktop_FilePromise::wait()
 {
-    promise.wait();
+    if (!has_result)
+    {
+        promise.wait();
+    }
 }
 
 #else
@@ -75,6 +117,17 @@ void desktop_FilePromise::wait()
 void em_dataLoaded(void* userdata, void* data, int size)
 {
     auto fp = (web_FilePromise*)userdata;
+
+    // The whole file is always downloaded, so a ranged read copies its part out of it
+    if (fp->op == Operation::ReadInto)
+    {
+        uint64_t start = std::min<uint64_t>(fp->offset, size);
+        uint64_t amount = std::min<uint64_t>(fp->length, size - start);
+        memcpy(fp->dest, (char*)data + start, amount);
+        fp->setData(fp->dest, amount);
+        return;
+    }
+
     auto buffer = new char[size];
     memcpy(buffer, data, size);
     fp->setData(buffer, size);
@@ -85,10 +138,10 @@ void em_error(void* userdata)
     std::cerr << "File failed to load\n";
 }
 
-web_FilePromise::web_FilePromise(std::filesystem::path file, Operation op, char* data, uint32_t isize):
-FilePromise(file, op, data, isize)
+web_FilePromise::web_FilePromise(std::filesystem::path file, Operation op, char* data, uint64_t isize, uint64_t offset):
+FilePromise(file, op, data, isize, offset), op(op), dest(data), offset(offset), length(isize)
 {
-    if (op == Operation::Write)
+    if (op != Operation::Read && op != Operation::ReadInto)
     {
         // Um.....
         // TODO: Implement this
@@ -100,7 +153,7 @@ FilePromise(file, op, data, isize)
     }
 }
 
-void web_FilePromise::setData(char* data, uint32_t size)
+void web_FilePromise::setData(char* data, uint64_t size)
 {
     this->data = data;
     this->size = size;
@@ -112,7 +165,7 @@ bool web_FilePromise::isDone() const
     return done;
 }
 
-char* web_FilePromise::get(uint32_t &size)
+char* web_FilePromise::get(uint64_t &size)
 {
     size = this->size;
     return data;
@@ -137,6 +190,15 @@ FilePromise* AsyncFiles::read(std::filesystem::path filename)
 #endif
 }
 
+FilePromise* AsyncFiles::read(std::filesystem::path filename, uint64_t offset, uint64_t length, char* dest)
+{
+#ifndef __EMSCRIPTEN__
+    return new desktop_FilePromise(filename, Operation::ReadInto, dest, length, offset);
+#else
+    return new web_FilePromise(filename, Operation::ReadInto, dest, length, offset);
+#endif
+}
+
 FilePromise* AsyncFiles::write(std::filesystem::path filename, char* data, uint32_t size)
 {
 #ifndef __EMSCRIPTEN__
@@ -146,6 +208,25 @@ FilePromise* AsyncFiles::write(std::filesystem::path filename, char* data, uint3
 #endif
 }
 
+FilePromise* AsyncFiles::writeFrom(std::filesystem::path filename, const char* data, uint64_t size)
+{
+    // The data is only ever read
+#ifndef __EMSCRIPTEN__
+    return new desktop_FilePromise(filename, Operation::WriteFrom, const_cast<char*>(data), size);
+#else
+    return new web_FilePromise(filename, Operation::WriteFrom, const_cast<char*>(data), size);
+#endif
+}
+
+FilePromise* AsyncFiles::writeAt(std::filesystem::path filename, uint64_t offset, const char* data, uint64_t size)
+{
+#ifndef __EMSCRIPTEN__
+    return new desktop_FilePromise(filename, Operation::WriteAt, const_cast<char*>(data), size, offset);
+#else
+    return new web_FilePromise(filename, Operation::WriteAt, const_cast<char*>(data), size, offset);
+#endif
+}
+
 void AsyncFiles::close(FilePromise *file)
 {
     delete file;
@@ -0,0 +1,283 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "FluxArc/FluxArc.hh"
+#include "AsyncFiles/AsyncFiles.hh"
+
+/*
+FluxArcBench: generates synthetic archives and measures opening, lookups, reads and writes.
+Every result is written as one JSON object per line to the --out file, so runs can be compared by a script.
+
+Usage: FluxArcBench [--entries 10,1000,100000,1000000] [--sizes 64,4096,1048576] [--data compressible,random]
+                    [--samples 10000] [--max-bytes 1073741824] [--dir .] [--out bench_results.jsonl]
+*/
+
+using Clock = std::chrono::steady_clock;
+
+struct Config
+{
+    std::vector<uint64_t> entries = {10, 1000, 100000, 1000000};
+    std::vector<uint64_t> sizes = {64, 4096, 1024 * 1024};
+    std::vector<std::string> data = {"compressible", "random"};
+    uint64_t samples = 10000;
+    uint64_t max_bytes = 1024ull * 1024 * 1024;
+    std::string dir = ".";
+    std::string out = "bench_results.jsonl";
+};
+
+// Archive logs to std::cout, so results go to their own file
+static std::ofstream results;
+
+static double secondsSince(Clock::time_point start)
+{
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+static std::vector<uint64_t> parseList(const std::string& list)
+{
+    std::vector<uint64_t> output;
+    std::stringstream ss(list);
+    std::string item;
+    while (std::getline(ss, item, ','))
+    {
+        output.push_back(std::stoull(item));
+    }
+    return output;
+}
+
+static std::vector<std::string> parseNames(const std::string& list)
+{
+    std::vector<std::string> output;
+    std::stringstream ss(list);
+    std::string item;
+    while (std::getline(ss, item, ','))
+    {
+        output.push_back(item);
+    }
+    return output;
+}
+
+/** Fills the buffer with data that's either random or compresses about as well as text */
+static void generate(char* buffer, uint64_t size, bool compressible)
+{
+    std::mt19937_64 rng(size);
+
+    if (!compressible)
+    {
+        for (uint64_t i = 0; i < size; i += sizeof(uint64_t))
+        {
+            uint64_t value = rng();
+            std::memcpy(buffer + i, &value, std::min<uint64_t>(sizeof(uint64_t), size - i));
+        }
+        return;
+    }
+
+    static const char* words[] = {"texture ", "mesh ", "shader ", "vertex ", "0.5f, ", "1.0f, ", "{\"id\": ", "}\n"};
+    uint64_t i = 0;
+    while (i < size)
+    {
+        const char* word = words[rng() % 8];
+        uint64_t length = std::min<uint64_t>(strlen(word), size - i);
+        std::memcpy(buffer + i, word, length);
+        i += length;
+    }
+}
+
+static std::string entryName(uint64_t i)
+{
+    // Spread over directories, like a real asset tree
+    return "dir" + std::to_string(i % 64) + "/entry" + std::to_string(i);
+}
+
+static void printResult(const std::string& bench, uint64_t entries, uint64_t size, const std::string& data, const std::string& extra)
+{
+    results << "{\"bench\": \"" << bench << "\", \"entries\": " << entries << ", \"size\": " << size
+            << ", \"data\": \"" << data << "\", " << extra << "}" << std::endl;
+}
+
+static std::string throughput(double seconds, uint64_t bytes)
+{
+    std::stringstream ss;
+    ss << "\"seconds\": " << seconds << ", \"bytes\": " << bytes << ", \"mb_per_s\": " << (bytes / (1024.0 * 1024.0)) / std::max(seconds, 1e-9);
+    return ss.str();
+}
+
+/** Times every call and reports the latency percentiles in microseconds */
+template <typename F>
+static std::string latency(uint64_t samples, F call)
+{
+    std::vector<double> times;
+    times.reserve(samples);
+    for (uint64_t i = 0; i < samples; i++)
+    {
+        auto start = Clock::now();
+        call(i);
+        times.push_back(secondsSince(start) * 1e6);
+    }
+
+    std::sort(times.begin(), times.end());
+    auto percentile = [&times](double p)
+    {
+        return times.empty() ? 0.0 : times[std::min<size_t>(times.size() - 1, (size_t)(p * times.size()))];
+    };
+
+    std::stringstream ss;
+    ss << "\"samples\": " << samples << ", \"p50_us\": " << percentile(0.5) << ", \"p90_us\": " << percentile(0.9)
+       << ", \"p99_us\": " << percentile(0.99) << ", \"max_us\": " << (times.empty() ? 0.0 : times.back());
+    return ss.str();
+}
+
+static void runConfig(const Config& config, uint64_t entries, uint64_t size, const std::string& data)
+{
+    bool compressible = data == "compressible";
+    std::string filename = config.dir + "/bench_" + std::to_string(entries) + "_" + std::to_string(size) + "_" + data + ".farc";
+    std::filesystem::remove(filename);
+
+    // Every entry shares one buffer, so only one entry's worth of memory is needed
+    std::vector<char> buffer(size);
+    generate(buffer.data(), size, compressible);
+
+    // Build the archive in one go
+    {
+        std::vector<FluxArc::NewFile> files;
+        files.reserve(entries);
+        for (uint64_t i = 0; i < entries; i++)
+        {
+            files.push_back({entryName(i), buffer.data(), size, compressible, false});
+        }
+
+        FluxArc::Archive archive(filename, true);
+        auto start = Clock::now();
+        archive.setFiles(files);
+        printResult("build", entries, size, data, throughput(secondsSince(start), entries * size));
+    }
+
+    uint64_t archive_size = std::filesystem::file_size(filename);
+    std::mt19937_64 rng(entries);
+    uint64_t samples = std::min(config.samples, std::max<uint64_t>(entries, 1) * 10);
+
+    std::vector<char> output(size);
+    for (bool dynamic : {true, false})
+    {
+        std::string mode = dynamic ? "\"mode\": \"dynamic\", " : "\"mode\": \"preload\", ";
+
+        auto start = Clock::now();
+        FluxArc::Archive archive(filename, dynamic);
+        printResult("open", entries, size, data, mode + throughput(secondsSince(start), archive_size));
+
+        printResult("hasFile", entries, size, data, mode + latency(samples, [&](uint64_t i)
+        {
+            // Every other lookup misses
+            std::string name = (i % 2) ? entryName(rng() % entries) : "missing/" + std::to_string(i);
+            volatile bool found = archive.hasFile(name);
+            (void)found;
+        }));
+
+        uint64_t read_samples = std::min<uint64_t>(samples, std::max<uint64_t>(1, config.max_bytes / std::max<uint64_t>(size, 1)));
+        printResult("getFile", entries, size, data, mode + latency(read_samples, [&](uint64_t i)
+        {
+            archive.getFile(entryName(rng() % entries), output.data());
+        }));
+    }
+
+    // A single setFile on an existing archive rebuilds it
+    {
+        FluxArc::Archive archive(filename, true);
+        auto start = Clock::now();
+        archive.setFile("extra", buffer.data(), size, compressible);
+        printResult("setFile", entries, size, data, throughput(secondsSince(start), archive_size));
+
+        start = Clock::now();
+        archive.rebuild();
+        printResult("rebuild", entries, size, data, throughput(secondsSince(start), archive_size));
+    }
+
+    // Reading the whole archive file with AsyncFiles
+    {
+        auto start = Clock::now();
+        auto promise = AsyncFiles::read(filename);
+        promise->wait();
+        uint64_t read_size;
+        delete[] promise->get(read_size);
+        AsyncFiles::close(promise);
+        printResult("asyncRead", entries, size, data, throughput(secondsSince(start), read_size));
+    }
+
+    // Reading single entries with AsyncFiles, straight into a buffer that's re-used
+    {
+        FluxArc::Archive archive(filename, true);
+        auto infos = archive.listFiles();
+        std::vector<char> stored(size + 1024);
+        uint64_t read_samples = std::min<uint64_t>(samples, std::max<uint64_t>(1, config.max_bytes / std::max<uint64_t>(size, 1)));
+        printResult("asyncReadEntry", entries, size, data, latency(read_samples, [&](uint64_t i)
+        {
+            auto& info = infos[rng() % infos.size()];
+            stored.resize(std::max<uint64_t>(stored.size(), info.stored_size));
+
+            auto promise = AsyncFiles::read(archive.getVolumeFilename(info.volume), info.offset, info.stored_size, stored.data());
+            uint64_t read_size;
+            promise->get(read_size);
+            AsyncFiles::close(promise);
+        }));
+    }
+
+    std::filesystem::remove(filename);
+}
+
+int main(int argc, char** argv)
+{
+    Config config;
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        std::string arg = argv[i];
+        std::string value = argv[i + 1];
+
+        if (arg == "--entries") config.entries = parseList(value);
+        else if (arg == "--sizes") config.sizes = parseList(value);
+        else if (arg == "--data") config.data = parseNames(value);
+        else if (arg == "--samples") config.samples = std::stoull(value);
+        else if (arg == "--max-bytes") config.max_bytes = std::stoull(value);
+        else if (arg == "--dir") config.dir = value;
+        else if (arg == "--out") config.out = value;
+        else
+        {
+            std::cerr << "Unknown option " << arg << "\n";
+            return 1;
+        }
+    }
+
+    results.open(config.out, std::ios::out | std::ios::app);
+    if (!results)
+    {
+        std::cerr << "Could not open " << config.out << "\n";
+        return 1;
+    }
+
+    for (auto entries : config.entries)
+    {
+        for (auto size : config.sizes)
+        {
+            for (auto& data : config.data)
+            {
+                // Keep the default run to a sensible amount of disk space
+                if (entries * size > config.max_bytes)
+                {
+                    continue;
+                }
+
+                runConfig(config, entries, size, data);
+            }
+        }
+    }
+
+    return 0;
+}
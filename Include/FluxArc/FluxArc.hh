@@ -6,9 +6,25 @@
 #include <iostream>
 #include <sstream>
 #include <string>
+#include <istream>
+#include <memory>
 #include <map>
+#include <set>
+#include <functional>
+#include <vector>
+#include <deque>
+#include <filesystem>
+#include <mutex>
+#include <shared_mutex>
+#include <future>
+#include <memory_resource>
+#include <atomic>
+#include <thread>
+#include <algorithm>
 
-#define FLUX_ARC_VERSION 1
+#define FLUX_ARC_VERSION 7
+
+struct XXH64_state_s;
 
 namespace FluxArc
 {
@@ -21,6 +37,16 @@ namespace FluxArc
         uint64_t file_size;
 
         uint32_t file_quantity;
+
+        // What every file's data is aligned to. Stored from version 5
+        uint32_t alignment;
+
+        // Stored from version 6. The archive file itself is volume 0, and holds the file list.
+        // The generation goes up with every rebuild, and is part of the other volumes' names
+        uint32_t volume_count;
+        uint32_t generation;
+        // How much data a volume holds before the next one is started, or 0 for no limit
+        uint64_t volume_size;
     };
 
     struct FileHeader
@@ -28,42 +54,157 @@ namespace FluxArc
         uint32_t name_size;
         bool compressed;
         uint64_t position;
-        uint32_t file_size_uc;
-        uint32_t file_size_c;
+        uint64_t file_size_uc;
+        uint64_t file_size_c;
+
+        // Which volume the data is in. Stored from version 6
+        uint32_t volume;
+
+        // XXH64 of the stored (possibly compressed) data. Stored from version 7
+        uint64_t checksum;
+
+        // Stored together with compressed in the flags byte
+        bool removed;
+        bool hidden;
+        bool chunked;
+
+        // Not stored: where this file's header is in the archive
+        uint64_t index_position;
+    };
+
+    /** Information about a file in the archive, as returned by listFiles */
+    struct FileInfo
+    {
+        std::string name;
+        uint64_t size;
+        uint64_t stored_size;
+        bool compressed;
+        // Where the stored data starts in its volume's file
+        uint64_t offset;
+        uint32_t volume;
+        // XXH64 of the stored data, or 0 in archives from before version 7
+        uint64_t checksum;
+    };
+
+    /** A file to add to an archive with Archive::setFiles */
+    struct NewFile
+    {
+        std::string name;
+        const char* data;
+        uint64_t size;
+        bool compressed;
+        bool compress_release;
+
+        // If data is nullptr, the file is read from this path instead, a piece at a time
+        std::string path;
+    };
+
+    /** A snapshot of what an archive has done since stats were enabled, as returned by Archive::getStats */
+    struct ArchiveStats
+    {
+        // Reads in a dynamic archive come from disk, otherwise from memory
+        uint64_t disk_reads;
+        uint64_t disk_read_bytes;
+        uint64_t memory_reads;
+        uint64_t memory_read_bytes;
+
+        uint64_t decompressions;
+        uint64_t decompressed_bytes;
+        uint64_t decompress_nanoseconds;
+
+        uint64_t compressions;
+        uint64_t compressed_bytes;
+        uint64_t compress_nanoseconds;
+
+        uint64_t rebuilds;
+        uint64_t rebuild_nanoseconds;
+    };
+
+    /** Passed to the hook set with Archive::setTraceHook for every read, (de)compression and rebuild */
+    struct TraceEvent
+    {
+        enum Type {Read, Decompress, Compress, Rebuild};
+
+        Type type;
+        // Only valid during the call. Empty for rebuilds
+        const std::string& name;
+        uint64_t bytes;
+        // 0 for reads
+        uint64_t nanoseconds;
+        bool from_disk;
     };
 
+    typedef std::function<void(const TraceEvent& event)> TraceHook;
+
+    /** What Archive::verify found */
+    struct VerifyResult
+    {
+        uint64_t files;
+        // Stored (possibly compressed) bytes that were checked
+        uint64_t bytes;
+        double seconds;
+        double gigabytes_per_second;
+
+        // Files whose data doesn't match its checksum, or couldn't be read
+        std::vector<std::string> broken;
+    };
+
+    /**
+    The memory resource used when no other one is given. It allocates with new[] and frees with delete[],
+    so memory from new char[] can be given to anything that uses it (like BinaryFile)
+    */
+    std::pmr::memory_resource* defaultMemoryResource();
+
+    /**
+    Calls work for every index below count, spread over up to thread_count threads (including this one).
+    If any call throws, the first exception is re-thrown once every thread is done
+    */
+    void parallelFor(size_t count, unsigned int thread_count, const std::function<void(size_t)>& work);
+
     /** A little helper class for creating binary files */
     class BinaryFile
     {
     public:
-        BinaryFile()
+        BinaryFile(std::pmr::memory_resource* resource = defaultMemoryResource())
         {
             index = 0;
             size = 0;
+            this->resource = resource;
             // std::cout << "Created binary file" << std::endl;
         }
 
-        BinaryFile(char* data, uint32_t size)
+        /**
+        Takes ownership of data, which has to have been allocated from the resource with the same size.
+        With the default resource, that means new char[size]
+        */
+        BinaryFile(char* data, uint64_t size, std::pmr::memory_resource* resource = defaultMemoryResource())
         {
             index = 0;
             this->data = data;
             this->size = size;
+            this->resource = resource;
 
             // std::cout << "Created binary file from data" << std::endl;
         }
 
+        /** The copy uses the same memory resource */
         BinaryFile(const BinaryFile &f)
         {
             index = f.index;
             size = f.size;
-            data = new char[size];
-            memcpy(data, f.data, size);
+            resource = f.resource;
+            if (f.data != nullptr)
+            {
+                data = (char*)resource->allocate(size, 1);
+                memcpy(data, f.data, size);
+            }
         }
 
         BinaryFile(BinaryFile&& f)
         {
             index = f.index;
             size = f.size;
+            resource = f.resource;
             data = f.data;
             f.data = nullptr;
         }
@@ -72,7 +213,7 @@ namespace FluxArc
         {
             if (data != nullptr)
             {
-                delete[] data;
+                resource->deallocate(data, size, 1);
                 data = nullptr;
             }
             // std::cout << "Destroyed BinaryFile" << std::endl;
@@ -85,11 +226,11 @@ namespace FluxArc
             set((char*)&object, sizeof(T));
         }
 
-        void set(const char* to_add_data, uint32_t to_add_size)
+        void set(const char* to_add_data, uint64_t to_add_size)
         {
             if (index + to_add_size > size)
             {
-                char* new_data = new char[index + to_add_size];
+                char* new_data = (char*)resource->allocate(index + to_add_size, 1);
 
                 if (data != nullptr)
                 {
@@ -99,7 +240,7 @@ namespace FluxArc
 
                 if (data != nullptr)
                 {
-                    delete[] data;
+                    resource->deallocate(data, size, 1);
                 }
                 data = new_data;
                 size = index + to_add_size;
@@ -119,13 +260,13 @@ namespace FluxArc
         }
 
         /** Adds the given amount of bytes as headroom. The cursor stays at the same place */
-        void allocate(uint32_t add_size)
+        void allocate(uint64_t add_size)
         {
-            char* new_data = new char[size + add_size];
+            char* new_data = (char*)resource->allocate(size + add_size, 1);
             if (data != nullptr)
             {
                 memcpy(new_data, data, size);
-                delete[] data;
+                resource->deallocate(data, size, 1);
             }
 
             data = new_data;
@@ -134,7 +275,7 @@ namespace FluxArc
         }
 
         /** Gets an unspecified amount of data. You must free the result */
-        bool get(char* new_data, int new_size)
+        bool get(char* new_data, uint64_t new_size)
         {
             if (index + new_size > size)
             {
@@ -163,17 +304,14 @@ namespace FluxArc
             uint32_t string_size;
             get(&string_size);
 
-            char* str = new char[string_size];
-            get(str, string_size);
-
-            std::string output(str, string_size);
-            delete[] str;
+            std::string output(string_size, '\0');
+            get(&output[0], string_size);
 
             return output;
         }
 
         /** Move the writing/reading cursor in the file to the given position. If it fails, it will return false */
-        bool setCursor(uint32_t position)
+        bool setCursor(uint64_t position)
         {
             if (position > size)
             {
@@ -184,7 +322,7 @@ namespace FluxArc
         }
 
         /** Returns where the writing/reading cursor is currently located */
-        int getCursor() const
+        uint64_t getCursor() const
         {
             return index;
         }
@@ -194,23 +332,130 @@ namespace FluxArc
             return data;
         }
 
-        uint32_t getSize() const
+        uint64_t getSize() const
         {
             return size;
         }
 
+        /** Gets the memory resource the data is allocated from */
+        std::pmr::memory_resource* getMemoryResource() const;
+
     private:
-        uint32_t index;
+        uint64_t index;
         char* data = nullptr;
 
-        uint32_t size;
+        uint64_t size;
+        std::pmr::memory_resource* resource;
+
+    };
+
+    /**
+    Reads a file from an archive a piece at a time. Compressed files are decompressed one chunk
+    at a time, so the memory used stays the same no matter how big the file is.
+    Get one with Archive::openFile
+    */
+    class FileReader
+    {
+    public:
+        /**
+        Reads up to size bytes into data. Returns the amount of bytes read, which is 0 at the end of the file
+        */
+        uint64_t read(char* data, uint64_t size);
+
+        /** Gets the size of the whole file */
+        uint64_t getSize() const
+        {
+            return decompressing ? header.file_size_uc : header.file_size_c;
+        }
+
+        /** Gets how much of the file has been read */
+        uint64_t getPosition() const
+        {
+            return position;
+        }
+
+        bool isDone() const
+        {
+            return position == getSize();
+        }
+
+    private:
+        friend class Archive;
+
+        FileReader(const FileHeader& header, bool decompressing, std::unique_ptr<std::istream> stream, std::shared_ptr<const char> memory, std::pmr::memory_resource* resource, bool verifying);
+
+        /** Reads the next bytes of the stored (possibly compressed) data */
+        void readStored(char* data, uint64_t size);
+
+        /** Decompresses the next chunk into chunk */
+        void nextChunk();
+
+        FileHeader header;
+        bool decompressing;
+
+        // Where the data comes from: a stream in dynamic mode, otherwise the archive's memory
+        std::unique_ptr<std::istream> stream;
+        std::shared_ptr<const char> memory;
+        uint64_t stored_read = 0;
+
+        uint64_t position = 0;
+        std::pmr::vector<char> block;
+        std::pmr::vector<char> chunk;
+        uint64_t chunk_position = 0;
+
+        // Hashes the stored data as it's read, if it's being checked against the checksum
+        std::shared_ptr<XXH64_state_s> hash_state;
+    };
+
+    /** A std::streambuf over a FileReader, so a file can be read as a std::istream */
+    class FileStreamBuf : public std::streambuf
+    {
+    public:
+        FileStreamBuf(FileReader reader) : reader(std::move(reader)), buffer(64 * 1024) {}
+
+    protected:
+        int_type underflow() override;
+
+    private:
+        FileReader reader;
+        std::vector<char> buffer;
+    };
+
+    /** A std::istream over a file in an archive. Get one with Archive::openStream */
+    class FileStream : public std::istream
+    {
+    public:
+        FileStream(FileReader reader) : std::istream(nullptr), buf(std::move(reader))
+        {
+            rdbuf(&buf);
+        }
 
+    private:
+        FileStreamBuf buf;
     };
 
     class Archive
     {
     public:
-        Archive(const std::string& filename, bool dynamic = false);
+        /** How many of the most recent reads getAccessTrace keeps */
+        static const size_t ACCESS_TRACE_LIMIT = 65536;
+
+        /**
+        Opens an archive. Unless it's dynamic, all the data is loaded in one read.
+        If decompress_threads isn't 0, compressed files are also decompressed when the archive is opened,
+        using that many threads, so getting them later is just a copy.
+        Data loaded into memory comes from the resource; see setMemoryResource
+        */
+        Archive(const std::string& filename, bool dynamic = false, unsigned int decompress_threads = 0, std::pmr::memory_resource* resource = defaultMemoryResource());
+        /**
+        Opens an archive that's already in memory, like one that's embedded in the executable or was downloaded.
+        The file list is read straight out of the memory, and files are views into it, so nothing is read from disk
+        or copied (unless decompress_threads isn't 0, which decompresses compressed files like the other constructor).
+        Every view keeps the memory alive. For memory that's never freed, use a shared_ptr that doesn't own it:
+        std::shared_ptr<const char>(data, [](const char*) {}).
+        The archive is read only; anything that would change it throws
+        */
+        Archive(std::shared_ptr<const char> data, uint64_t size, unsigned int decompress_threads = 0, std::pmr::memory_resource* resource = defaultMemoryResource());
         Archive() {dynamic = true;};
         ~Archive();
 
@@ -222,49 +467,227 @@ namespace FluxArc
         /**
         Checks if a file exists within the archive
         */
-        bool hasFile(const std::string& fname)
+        bool hasFile(const std::string& fname) const
         {
+            std::shared_lock<std::shared_mutex> lock(state_mutex);
             return database.find(fname) != database.end();
         }
 
+        /**
+        Gets the amount of files in the archive
+        */
+        size_t getFileCount() const
+        {
+            std::shared_lock<std::shared_mutex> lock(state_mutex);
+            return database.size();
+        }
+
+        /**
+        Calls the callback for every file whose name starts with the prefix, in name order.
+        Only the matching files are visited
+        */
+        void forEachFile(const std::function<void(const FileInfo&)>& callback, const std::string& prefix = "") const;
+
+        /**
+        Lists every file whose name starts with the prefix, in name order
+        */
+        std::vector<FileInfo> listFiles(const std::string& prefix = "") const;
+
+        /**
+        Lists the files directly inside a directory (e.g. "textures/ui/"), without going into sub-directories.
+        The names of the sub-directories are put into subdirectories, if it's given
+        */
+        std::vector<FileInfo> listDirectory(const std::string& directory, std::vector<std::string>* subdirectories = nullptr) const;
+
         /**
         Gets the file size of a file in the archive
         */
-        int getFileSize(const std::string& fname);
+        uint64_t getFileSize(const std::string& fname);
+
+        /**
+        Gets where a file's stored data starts in the archive file, e.g. to map it into memory.
+        With setAlignment, this is a multiple of the alignment
+        */
+        uint64_t getFileOffset(const std::string& fname) const;
+
+        /**
+        Sets what every file's data is aligned to (a power of 2, like 16, 64 or 4096), so uncompressed files
+        can be mapped or read straight into SIMD or page-aligned buffers. It's stored in the archive and
+        used from the next rebuild on; call rebuild() to apply it straight away.
+        Data loaded into memory is aligned the same way
+        */
+        void setAlignment(uint32_t alignment);
+
+        /**
+        Gets the alignment of the files' data, as the archive is now
+        */
+        uint32_t getAlignment() const
+        {
+            std::shared_lock<std::shared_mutex> lock(state_mutex);
+            return header.alignment;
+        }
+
+        /**
+        Splits the archive's data over several volume files of about this many bytes each (0 puts everything
+        in the archive file, which is the default). A volume only goes over the size if a single file doesn't fit.
+        The archive file stays volume 0 and holds the file list; the others are put next to it.
+        It's stored in the archive and used from the next rebuild on; call rebuild() to apply it straight away
+        */
+        void setVolumeSize(uint64_t size)
+        {
+            std::lock_guard<std::recursive_mutex> write_lock(write_mutex);
+            volume_size = size;
+        }
+
+        /**
+        Gets the amount of volume files the archive is made of, as the archive is now
+        */
+        uint32_t getVolumeCount() const
+        {
+            std::shared_lock<std::shared_mutex> lock(state_mutex);
+            return header.volume_count;
+        }
+
+        /**
+        Gets the name of a volume's file, e.g. to ship or mount it somewhere else.
+        The names change with every rebuild, so old volumes can be read until the new ones are complete
+        */
+        std::string getVolumeFilename(uint32_t volume) const
+        {
+            std::shared_lock<std::shared_mutex> lock(state_mutex);
+            return volumeFilename(volume, header.generation);
+        }
+
+        /**
+        Sets where the archive gets its memory from: files loaded into memory, decompressed files,
+        the buffers used while reading and writing, and the data of BinaryFiles it returns.
+        Only memory allocated after this call comes from the new resource, and the resource has
+        to outlive the archive, and every BinaryFile, view and reader that still uses its memory.
+        The archive allocates from several threads at once (when opening, decompressing, adding files with
+        threads, or with readers on several threads), so calls to resources that aren't known to be thread safe,
+        like std::pmr::monotonic_buffer_resource, are made one at a time behind a lock that's shared by
+        every archive using that resource
+        */
+        void setMemoryResource(std::pmr::memory_resource* resource);
+
+        /**
+        Gets the memory resource the archive allocates from, as it was given
+        */
+        std::pmr::memory_resource* getMemoryResource() const;
 
         /**
         Loads a file from the archive. Loads directly from disk.
         Returns the size of the loaded file
         */
-        int getFile(const std::string& fname, char* data, bool res_compressed=false);
+        uint64_t getFile(const std::string& fname, char* data, bool res_compressed=false);
 
         /**
         Gets a file from the archive as a string
         */
         std::string getFile(const std::string& fname);
 
+        /**
+        Loads several files at once, as if getFile was called for each of them; data[i] has to have
+        room for fnames[i]. The files are read in the order they're stored, with a thread per volume,
+        so a split archive is read from all its volumes at the same time. Returns the loaded sizes
+        */
+        std::vector<uint64_t> getFiles(const std::vector<std::string>& fnames, const std::vector<char*>& data, bool res_compressed=false);
+
         /**
         Gets a file as a BinaryFile
         */
         BinaryFile getBinaryFile(const std::string& fname)
         {
-            uint32_t size = getFileSize(fname);
-            char* buffer = new char[size];
-            getFile(fname, buffer);
+            std::pmr::memory_resource* resource = memory_resource;
+            uint64_t size = getFileSize(fname);
+            BinaryFile file((char*)resource->allocate(size, 1), size, resource);
+            getFile(fname, file.getDataPtr());
+
+            return file;
+        }
+
+        /**
+        Gets a file's data without copying it. This only works for files that are in memory and not
+        compressed (or already decompressed): in non-dynamic archives, uncompressed files and files
+        decompressed when the archive was opened. Returns nullptr for anything else.
+        The data stays valid for as long as the pointer is kept, even if the file is changed
+        */
+        std::shared_ptr<const char> getFileView(const std::string& fname);
+
+        /**
+        Opens a file for reading a piece at a time, instead of all at once
+        */
+        FileReader openFile(const std::string& fname, bool res_compressed=false);
 
-            return BinaryFile(buffer, size);
+        /**
+        Opens a file as a std::istream. It's read a piece at a time, like openFile
+        */
+        std::unique_ptr<std::istream> openStream(const std::string& fname)
+        {
+            return std::unique_ptr<std::istream>(new FileStream(openFile(fname)));
         }
 
+        /**
+        Reads a file a piece at a time, calling the callback with every piece. The pieces are only valid
+        during the call. Stops early if the callback returns false. Returns the amount of bytes read
+        */
+        uint64_t readFile(const std::string& fname, const std::function<bool(const char* data, uint64_t size)>& callback);
+
         /** 
-        Adds a file to the archive. This function is not smart; it re-builds the entire archive every time
+        Adds a file to the archive. If the file is already in the archive and the new version fits in its space,
+        it's written over the old one in place. Otherwise the entire archive is re-built
         */
-        void setFile(const std::string& fname, char* data, int size, bool compressed = false, bool compress_release = false);
+        void setFile(const std::string& fname, char* data, uint64_t size, bool compressed = false, bool compress_release = false);
+
+        /**
+        Turns writing changed files in place on or off. Writing in place is much faster than a rebuild,
+        but unlike one it isn't atomic: a crash while the file is written leaves it broken,
+        and FileReaders that are already reading it can see a mix of the old and new data
+        */
+        void setOverwriteInPlace(bool enabled)
+        {
+            std::lock_guard<std::recursive_mutex> write_lock(write_mutex);
+            overwrite_in_place = enabled;
+        }
+
+        /**
+        Turns checking files against their checksums on or off. When it's on, every read that uses a file's
+        stored data hashes all of it, and throws if it doesn't match. FileReaders check once they reach the end.
+        Files decompressed when the archive was opened were checked then (broken ones are never kept decompressed),
+        so reading them doesn't hash them again.
+        Archives from before version 7 have no checksums, so nothing is checked until they're rebuilt
+        */
+        void setVerifyOnRead(bool enabled)
+        {
+            verify_on_read.store(enabled, std::memory_order_relaxed);
+        }
+
+        /**
+        Checks every file's data against its checksum, using up to threads threads. Every thread reads
+        a run of files that are next to each other in the archive, so the disks only see sequential reads.
+        Throws if the archive is from before version 7, since it doesn't have checksums yet
+        */
+        VerifyResult verify(unsigned int threads = std::max(1u, std::thread::hardware_concurrency()));
+
+        /**
+        Adds a file to the archive, reading size bytes from the stream. The file is compressed and written
+        a piece at a time, so it never has to fit in memory (unless the archive isn't dynamic)
+        */
+        void setFile(const std::string& fname, std::istream& data, uint64_t size, bool compressed = false, bool compress_release = false);
 
         /**
         Adds a text file to the archive. This function is not smart; it re-builds the entire archive every time
         */
         void setFile(const std::string& fname, const std::string& data, bool compressed = false, bool compress_release = false);
 
+        /**
+        Adds several files to the archive with a single rebuild.
+        If a name is in the list more than once, the last one is used.
+        With more than one thread, small files are read and compressed in parallel (a batch at a time,
+        so they don't all have to fit in memory), and written in the order they were given
+        */
+        void setFiles(const std::vector<NewFile>& files, unsigned int threads = 1);
+
         /**
         Puts a BinaryFile into the FluxArc
         */
@@ -274,23 +697,388 @@ namespace FluxArc
         }
 
         /**
-        Removes a file from the archive. This function is not smart; it re-builds the entire archive
+        Removes a file from the archive. The file is only marked as removed in the archive's file list;
+        its data stays in the archive until the archive is compacted
         */
         void removeFile(const std::string& fname);
 
+        /**
+        Marks a file as hidden, removing it from this archive if it's there.
+        Hidden files stay in the archive's file list, so an archive mounted on top of others in an
+        Overlay can hide their files
+        */
+        void hideFile(const std::string& fname);
+
+        /**
+        Checks if a file has been hidden with hideFile
+        */
+        bool isHidden(const std::string& fname) const
+        {
+            std::shared_lock<std::shared_mutex> lock(state_mutex);
+            return hidden.find(fname) != hidden.end();
+        }
+
+        /**
+        Gets the names of all hidden files
+        */
+        std::set<std::string> getHiddenFiles() const
+        {
+            std::shared_lock<std::shared_mutex> lock(state_mutex);
+            return hidden;
+        }
+
+        /**
+        Gets the amount of bytes in the archive taken up by removed files,
+        and left unused by files that were overwritten in place with smaller ones
+        */
+        uint64_t getWastedBytes() const;
+
+        /**
+        Sets how many bytes removed files may waste before removeFile compacts the archive.
+        If background is true, the compaction is done with compactAsync
+        */
+        void setCompactionThreshold(uint64_t bytes, bool background = false)
+        {
+            compaction_threshold = bytes;
+            background_compaction = background;
+        }
+
+        /**
+        Rewrites the archive without the removed files
+        */
+        void compact();
+
+        /**
+        Compacts the archive on a background thread. Files can still be read while it runs;
+        they come from the old archive until the compacted one is swapped in
+        */
+        void compactAsync();
+
+        /**
+        Waits for a background compaction to finish, if one is running
+        */
+        void waitForCompaction();
+
+        /**
+        Turns automatic commits on or off. While they're off, setFile, setFiles, removeFile and hideFile only
+        stage their changes (copying any data they're given), and readers keep seeing the archive as it was.
+        commit() then writes all of them with a single rebuild. Turning it back on commits anything staged.
+        Changes that are still staged when the archive is destroyed are thrown away
+        */
+        void setAutoCommit(bool enabled);
+
+        bool isAutoCommit() const
+        {
+            std::lock_guard<std::mutex> lock(staging_mutex);
+            return auto_commit;
+        }
+
+        /**
+        Gets the amount of staged changes that haven't been committed yet
+        */
+        size_t getStagedCount() const
+        {
+            std::lock_guard<std::mutex> lock(staging_mutex);
+            return staged_files.size() + staged_removals.size() + staged_hides.size();
+        }
+
+        /**
+        Writes every staged change into a new archive and swaps it in all at once.
+        If it fails, the archive is left as it was and the changes stay staged
+        */
+        void commit();
+
+        /**
+        Commits on a background thread. Readers keep using the previous version until the new one is
+        swapped in, and changes staged while it runs go into the next commit
+        */
+        void commitAsync();
+
+        /**
+        Waits for background commits to finish. Re-throws the error if one failed
+        */
+        void waitForCommit();
+
         /**
         Rebuild the archive. Optionally do so with a new file
         */
         void rebuild();
-        void rebuild(const std::string& fname, char* data, int size, bool compressed = false, bool compress_release = false, bool new_file = true);
+        void rebuild(const std::string& fname, char* data, uint64_t size, bool compressed = false, bool compress_release = false, bool new_file = true);
+
+        /**
+        Picks up changes another process made to the archive file. If its size or modification time changed
+        (or it was changed too recently for its modification time to tell), only the file list is read again, and only files whose header or position changed are loaded again;
+        the others keep the data they already have. Readers keep using the old version until the new one
+        is swapped in. Returns false if nothing changed.
+        Archives from before version 7 have no checksums to tell changed files apart, so all their files are loaded
+        */
+        bool refresh();
+
+        /**
+        Starts or stops recording which files are read, in what order and how often.
+        repack() only uses how often each file was read and which file was read after which, so memory
+        doesn't grow with the amount of reads, and tracing can be left on
+        */
+        void setAccessTracing(bool enabled)
+        {
+            tracing.store(enabled, std::memory_order_relaxed);
+        }
+
+        bool isAccessTracing() const
+        {
+            return tracing.load(std::memory_order_relaxed);
+        }
+
+        /**
+        Gets the names of the last files read while tracing was enabled (up to ACCESS_TRACE_LIMIT of them),
+        in the order they were read
+        */
+        std::vector<std::string> getAccessTrace() const
+        {
+            std::lock_guard<std::mutex> lock(trace_mutex);
+            return std::vector<std::string>(access_trace.begin(), access_trace.end());
+        }
+
+        /**
+        Gets how often each file was read while tracing was enabled
+        */
+        std::map<std::string, uint64_t> getAccessCounts() const
+        {
+            std::lock_guard<std::mutex> lock(trace_mutex);
+            return access_counts;
+        }
+
+        /** Forgets the recorded access trace */
+        void clearAccessTrace()
+        {
+            std::lock_guard<std::mutex> lock(trace_mutex);
+            access_trace.clear();
+            access_counts.clear();
+            access_successors.clear();
+            last_access.clear();
+        }
+
+        /**
+        Starts or stops collecting runtime stats. When they're off, the only cost is checking a flag.
+        The counters can be read from any thread with getStats while the archive is in use
+        */
+        void setStatsEnabled(bool enabled);
+
+        bool isStatsEnabled() const
+        {
+            return stats_enabled.load(std::memory_order_relaxed);
+        }
+
+        /**
+        Gets the current value of the stats counters
+        */
+        ArchiveStats getStats() const;
+
+        /**
+        Gets how often each file was read while stats were enabled
+        */
+        std::map<std::string, uint64_t> getReadCounts() const;
+
+        /** Sets all the stats counters back to 0 */
+        void resetStats();
+
+        /**
+        Sets a function that's called for every read, decompression, compression and rebuild, whether or not
+        stats are enabled. It's called on the thread doing the work, so it should be quick. Pass nullptr to remove it
+        */
+        void setTraceHook(TraceHook hook);
+
+        /**
+        Re-orders the file data so that files that are read together are next to each other,
+        with the most read files at the front. Uses the recorded access trace
+        */
+        void repack();
+
+        /**
+        Re-orders the file data to follow the given order. Files not in the list are put after them
+        */
+        void repack(const std::vector<std::string>& order);
 
     private:
+        /** Fills the buffer with the next part of a file that's being added */
+        typedef std::function<void(char* buffer, uint64_t size)> FileSource;
+
+        /** A file that's being added by a rebuild */
+        struct PendingFile
+        {
+            std::string name;
+            FileSource source;
+            uint64_t size;
+            bool compressed;
+            bool compress_release;
+
+            // Where a staged file's data is kept until it's committed: a copy, or the path it's read from
+            std::shared_ptr<std::pmr::vector<char> > copy;
+            std::string path;
+
+            // The file's data as it's stored, if it's already been compressed, so a rebuild doesn't do it again
+            std::shared_ptr<std::pmr::vector<char> > prepared;
+        };
+
+        /** Adds a read to the access trace and the stats, if they're enabled */
+        void recordAccess(const std::string& fname, uint64_t bytes);
+
+        /** Checks if anything wants (de)compressions and rebuilds to be timed */
+        bool isTiming() const
+        {
+            return stats_enabled.load(std::memory_order_relaxed) || has_trace_hook.load(std::memory_order_relaxed);
+        }
+
+        /** Adds a timed event to the stats and calls the trace hook */
+        void recordEvent(TraceEvent::Type type, const std::string& fname, uint64_t bytes, uint64_t nanoseconds);
+
+        /** Calls the trace hook, if there is one */
+        void callTraceHook(const TraceEvent& event);
+
+        /** Decompresses every compressed file into decompressed_data, using decompress_threads threads */
+        void decompressAll();
+
+        /** Loads a file without recording it in the access trace */
+        uint64_t loadFile(const std::string& fname, char* data, bool res_compressed);
+
+        /** Reads a file from its volume, which the stream is already at. The caller holds state_mutex */
+        uint64_t readFromDisk(const std::string& fname, const FileHeader& fh, std::istream& wf, char* data, bool res_compressed);
+
+        /** Gets the names of all files, in the order their data is stored in the archive */
+        std::vector<std::string> diskOrder() const;
+
+        /**
+        Rebuilds the archive, writing the existing files' data in the given order.
+        Data is streamed into the new archive, so neither it nor any file has to fit in memory
+        */
+        void rebuild(const std::vector<std::string>& order, const std::vector<PendingFile>& files, unsigned int threads = 1, const std::set<std::string>& hides = {});
+
+        /** Stages new files if auto commit is off. Returns false if they should be written now instead */
+        bool stageFiles(const std::vector<PendingFile>& files, unsigned int threads = 1);
+
+        /** Stages removing or hiding a file if auto commit is off. Returns false if it should be done now instead */
+        bool stageRemoval(const std::string& fname, bool hide);
+
+        /** Reads a new file, compressing it if it should be. Used to prepare files on other threads */
+        std::pmr::vector<char> prepareFile(const PendingFile& file);
+
+        /**
+        Writes a changed file over its old data, if it fits in the space before the next file.
+        Returns false if it doesn't fit, and the archive has to be rebuilt instead. If the file was compressed
+        to find out, the compressed data is put in file.prepared for the rebuild
+        */
+        bool overwriteInPlace(PendingFile& file, const char* data);
+
+        /** Writes a single file header back into the archive, without touching anything else */
+        void writeFileHeader(const std::string& fname, const FileHeader& fh);
+
+        /** Throws if the archive can't be changed */
+        void checkWritable() const;
+
+        /** Gets the name of a volume's file. Volume 0 is the archive file itself */
+        std::string volumeFilename(uint32_t volume, uint32_t generation) const;
+
+        /** Opens a volume of the archive as it is now, for reading */
+        std::ifstream openVolume(uint32_t volume) const;
+
+        /** Gets the size of every volume's file in an archive with this header. Throws if one is missing */
+        std::vector<uint64_t> findVolumes(const Header& h) const;
+
+        /** Remembers the archive file's size and modification time, so refresh() knows what it has seen */
+        void recordDiskState();
+
+        // Readers hold state_mutex shared. Anything that changes the archive holds write_mutex for the
+        // whole change, and only locks state_mutex exclusively to swap in the result
+        mutable std::shared_mutex state_mutex;
+        std::recursive_mutex write_mutex;
+
         Header header;
         std::map<std::string, FileHeader> database;
+        std::map<std::string, FileHeader> tombstones;
+        std::set<std::string> hidden;
         std::string archive_filename;
 
         bool dynamic;
-        std::map<std::string, char* > file_data;
+        unsigned int decompress_threads = 0;
+
+        // Files' data as stored in the archive, and decompressed if that was done when opening.
+        // Data is never changed in place; a changed file gets a new buffer
+        std::map<std::string, std::shared_ptr<char> > file_data;
+        std::map<std::string, std::shared_ptr<char> > decompressed_data;
+        std::atomic<std::pmr::memory_resource*> memory_resource{defaultMemoryResource()};
+
+        bool overwrite_in_place = true;
+        // Archives opened from memory can't be changed
+        bool read_only = false;
+        std::atomic<bool> verify_on_read{false};
+        // The alignment and volume size the next rebuild will use
+        uint32_t alignment = 1;
+        uint64_t volume_size = 0;
+        // The size of every volume's file
+        std::vector<uint64_t> volume_sizes;
+        // Space left between files that were overwritten in place and the file after them
+        uint64_t slack_bytes = 0;
+        // The archive file as it was last read or written by this archive
+        uint64_t disk_size = 0;
+        std::filesystem::file_time_type disk_time;
+        // When disk_size and disk_time were read
+        std::filesystem::file_time_type disk_checked;
+
+        uint64_t compaction_threshold = 64 * 1024 * 1024;
+        bool background_compaction = false;
+        std::mutex compaction_mutex;
+        std::future<void> compaction;
+
+        // Changes waiting for commit(). They have their own lock instead of write_mutex,
+        // so changes can be staged while a commit is being written
+        mutable std::mutex staging_mutex;
+        bool auto_commit = true;
+        std::vector<PendingFile> staged_files;
+        std::set<std::string> staged_removals;
+        std::set<std::string> staged_hides;
+        unsigned int staged_threads = 1;
+        // Names of the new files in the commit that's being written
+        std::set<std::string> committing;
+
+        std::mutex commit_mutex;
+        std::future<void> background_commit;
+
+        // Checked before trace_mutex is taken, so reads don't lock anything while tracing is off
+        mutable std::mutex trace_mutex;
+        std::atomic<bool> tracing{false};
+        std::deque<std::string> access_trace;
+        std::map<std::string, uint64_t> access_counts;
+        // How often each file was read straight after another one
+        std::map<std::string, std::map<std::string, uint64_t> > access_successors;
+        std::string last_access;
+
+        // Stats are plain atomics, so collecting and reading them never takes a lock
+        struct StatCounters
+        {
+            std::atomic<uint64_t> disk_reads{0};
+            std::atomic<uint64_t> disk_read_bytes{0};
+            std::atomic<uint64_t> memory_reads{0};
+            std::atomic<uint64_t> memory_read_bytes{0};
+            std::atomic<uint64_t> decompressions{0};
+            std::atomic<uint64_t> decompressed_bytes{0};
+            std::atomic<uint64_t> decompress_nanoseconds{0};
+            std::atomic<uint64_t> compressions{0};
+            std::atomic<uint64_t> compressed_bytes{0};
+            std::atomic<uint64_t> compress_nanoseconds{0};
+            std::atomic<uint64_t> rebuilds{0};
+            std::atomic<uint64_t> rebuild_nanoseconds{0};
+        };
+
+        std::atomic<bool> stats_enabled{false};
+        StatCounters stats;
+
+        // One counter per file. The map only changes under state_mutex held exclusively,
+        // so readers that hold it shared can bump the counters directly
+        std::map<std::string, std::unique_ptr<std::atomic<uint64_t> > > read_counts;
+
+        // Read with std::atomic_load, so it can be swapped while other threads are reading
+        std::atomic<bool> has_trace_hook{false};
+        std::shared_ptr<const TraceHook> trace_hook;
     };
 }
 
@@ -0,0 +1,106 @@
+#ifndef FLUXARC_OVERLAY_HH
+#define FLUXARC_OVERLAY_HH
+
+#include "FluxArc/FluxArc.hh"
+
+#include <memory>
+
+namespace FluxArc
+{
+    /** A small Bloom filter over file names, used to skip layers that can't have a file */
+    class BloomFilter
+    {
+    public:
+        BloomFilter(size_t expected_items = 0);
+
+        /** Hashes a name. Hash it once and re-use the result for every filter */
+        static std::pair<uint64_t, uint64_t> hash(const std::string& name);
+
+        void add(const std::pair<uint64_t, uint64_t>& hashes);
+
+        /** Returns false if the name was definitely never added */
+        bool mightContain(const std::pair<uint64_t, uint64_t>& hashes) const;
+
+    private:
+        std::vector<uint64_t> bits;
+        uint64_t bit_count;
+    };
+
+    /**
+    A stack of archives that act like a single one. Archives mounted later shadow files
+    in the ones mounted before them, and can hide their files with Archive::hideFile.
+    This means a patch can be shipped as a small archive instead of rewriting the base one
+    */
+    class Overlay
+    {
+    public:
+        /**
+        Opens an archive and mounts it on top of the stack
+        */
+        void mount(const std::string& filename, bool dynamic = true);
+
+        /**
+        Mounts an archive on top of the stack
+        */
+        void mount(std::shared_ptr<Archive> archive);
+
+        /**
+        Rebuilds the lookup filters. Call this after changing an archive that's already mounted
+        */
+        void updateFilters();
+
+        /**
+        Gets the archive a file is read from, or nullptr if no layer has it
+        */
+        std::shared_ptr<Archive> findLayer(const std::string& fname) const;
+
+        /**
+        Checks if a file exists in any layer, and isn't hidden by a layer above it
+        */
+        bool hasFile(const std::string& fname) const
+        {
+            return findLayer(fname) != nullptr;
+        }
+
+        /**
+        Gets the file size of a file in the overlay
+        */
+        uint64_t getFileSize(const std::string& fname);
+
+        /**
+        Loads a file from the top-most layer that has it. Returns the size of the loaded file
+        */
+        uint64_t getFile(const std::string& fname, char* data, bool res_compressed=false);
+
+        /**
+        Gets a file from the overlay as a string
+        */
+        std::string getFile(const std::string& fname);
+
+        /**
+        Gets a file as a BinaryFile
+        */
+        BinaryFile getBinaryFile(const std::string& fname);
+
+        /**
+        Lists every visible file whose name starts with the prefix, in name order
+        */
+        std::vector<FileInfo> listFiles(const std::string& prefix = "") const;
+
+    private:
+        struct Layer
+        {
+            std::shared_ptr<Archive> archive;
+            BloomFilter filter;
+        };
+
+        /** Gets the layer or throws */
+        std::shared_ptr<Archive> getLayer(const std::string& fname) const;
+
+        static BloomFilter buildFilter(const Archive& archive);
+
+        std::vector<Layer> layers;
+    };
+}
+
+#endif
@@ -2,561 +2,3447 @@
 #include "FluxArc/FluxArc.hh"
 #include "lz4.h"
 #include "lz4hc.h"
+#include "xxhash.h"
 #include <fstream>
 #include <ios>
 #include <cstring>
 #include <exception>
 #include <iostream>
 #include <stdexcept>
+#include <algorithm>
+#include <set>
+#include <filesystem>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <exception>
+#include <random>
 
-using namespace FluxArc;
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
-// Helper functions
-char* decompress(char* data, size_t size_c, size_t size, int* out_size, bool free=true)
-{
-    char* output = new char [size];
-    int out = LZ4_decompress_safe(data, output, size_c, size);
+using namespace FluxArc;
 
-    if (out < 0)
-    {
-        throw std::invalid_argument("Error: LZ4 decompression failed");
-    }
-    
-    std::memcpy(out_size, &out, sizeof(out));
+// Compressed files are split into independently compressed chunks of this size, so neither
+// compressing nor decompressing ever needs more than one chunk in memory.
+// Each chunk is stored as its compressed size (uint32_t) followed by the LZ4 block
+static const uint64_t COMPRESSION_CHUNK_SIZE = 4 * 1024 * 1024;
 
-    if (free)
-    {
-        delete[] data;
-    }
-    
-    return output;
-}
+// How much data is copied at a time when streaming between files
+static const uint64_t COPY_BUFFER_SIZE = 1024 * 1024;
 
-char* compress(char* data, size_t size, int* out_size, bool release)
-{
-    
-    auto dst_size = LZ4_compressBound(size);
+// How much new data is read and compressed at once when adding files with several threads
+static const uint64_t PARALLEL_BATCH_SIZE = 64 * 1024 * 1024;
 
-    // One char = one byte. Remember that
-    char* output = new char [dst_size];
+// How much data each thread checks in one go in Archive::verify
+static const uint64_t VERIFY_RUN_SIZE = 64 * 1024 * 1024;
 
-    int out = 0;
-    if (release)
+// Helper functions
+/**
+Makes sure a file that's been written and closed is on the disk, and not just in the OS's cache,
+so it survives a power loss or a kernel crash. Throws if it can't be done
+*/
+static void syncFile(const std::string& filename)
+{
+#ifdef _WIN32
+    HANDLE file = CreateFileA(filename.c_str(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+        nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    bool synced = file != INVALID_HANDLE_VALUE && FlushFileBuffers(file);
+    if (file != INVALID_HANDLE_VALUE)
     {
-        // MAXIMUM COMPRESSION!!!!
-        // Also maximum time, but that's not important
-        out = LZ4_compress_HC(data, output, size, dst_size, LZ4HC_CLEVEL_MAX);
+        CloseHandle(file);
     }
-    else
+#else
+    int file = ::open(filename.c_str(), O_WRONLY);
+    bool synced = file >= 0 && ::fsync(file) == 0;
+    if (file >= 0)
     {
-        out = LZ4_compress_default(data, output, size, dst_size);
+        ::close(file);
     }
+#endif
 
-    if (out == 0)
+    if (!synced)
     {
-        throw std::invalid_argument("Error: LZ4 compression failed");
+        throw std::runtime_error("Error: Could not write archive");
     }
+}
 
-    int size_var = out;
-    std::memcpy(out_size, &size_var, sizeof(int));
-
-    // delete[] data;
+/**
+Makes sure renames in a directory are on the disk. Windows doesn't need (or allow) this.
+Some file systems can't sync directories, so that's not an error
+*/
+static void syncDirectory(const std::filesystem::path& directory)
+{
+#ifndef _WIN32
+    int dir = ::open(directory.empty() ? "." : directory.c_str(), O_RDONLY);
+    if (dir >= 0)
+    {
+        ::fsync(dir);
+        ::close(dir);
+    }
+#endif
+}
 
-    return output;
+/** Gets a name for a new file next to filename that no other writer will use */
+static std::string uniqueTempFilename(const std::string& filename)
+{
+    std::random_device random;
+    uint64_t id = ((uint64_t)random() << 32) ^ random() ^ (uint64_t)std::chrono::steady_clock::now().time_since_epoch().count();
+    return filename + ".tmp." + std::to_string(id);
 }
 
-Archive::Archive(const std::string& filename, bool dynamic)
+/** Deletes files when it goes out of scope, if they're still there, so failed writes don't leave them behind */
+struct TempFileGuard
 {
-    this->dynamic = dynamic;
-    std::ifstream wf(filename, std::ifstream::ate | std::ios::in | std::ios::binary);
-    archive_filename = filename;
+    std::vector<std::string> filenames;
 
-    if (!wf || !wf.good())
+    ~TempFileGuard()
     {
-        // File doesn't exist - new archive
-        header = Header();
+        for (auto& filename : filenames)
+        {
+            std::error_code error;
+            std::filesystem::remove(filename, error);
+        }
+    }
+};
 
-        // No idea what this does, or if this works
-        header.magic_number = 5639;
+/** Gets a timestamp in nanoseconds, for timing things for the stats */
+static uint64_t nowNanoseconds()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
 
-        header.version = FLUX_ARC_VERSION;
-        header.file_size = sizeof(Header);
-        header.file_quantity = 0;
+/** Allocates with new[] and frees with delete[], so its memory is interchangeable with new char[] */
+class ArrayResource : public std::pmr::memory_resource
+{
+protected:
+    void* do_allocate(size_t bytes, size_t alignment) override
+    {
+        if (alignment <= __STDCPP_DEFAULT_NEW_ALIGNMENT__)
+        {
+            return new char[bytes];
+        }
 
-        database = std::map<std::string, FileHeader>();
-        return;
+        return ::operator new[](bytes, static_cast<std::align_val_t>(alignment));
     }
 
-    // Load files
-    Header memblock;
+    void do_deallocate(void* data, size_t bytes, size_t alignment) override
+    {
+        if (alignment <= __STDCPP_DEFAULT_NEW_ALIGNMENT__)
+        {
+            delete[] (char*)data;
+            return;
+        }
 
-    // Check file size
-    std::streampos size;
-    // wf.seekg(std::ios::end);
-    size = wf.tellg();
-    wf.seekg(0, wf.beg);
-    
+        ::operator delete[](data, static_cast<std::align_val_t>(alignment));
+    }
 
-    if (size < sizeof(Header))
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
     {
-        throw std::invalid_argument("Error: File is to small to be a valid FluxArc");
+        return this == &other;
     }
+};
 
-    // Get header
-    // wf.read((char *)&memblock, sizeof(Header));
-    wf.read((char*)&memblock.magic_number, sizeof(std::uint16_t));
-    wf.read((char*)&memblock.version, sizeof(std::uint16_t));
-    wf.read((char*)&memblock.file_size, sizeof(std::uint64_t));
-    wf.read((char*)&memblock.file_quantity, sizeof(std::uint32_t));
+std::pmr::memory_resource* FluxArc::defaultMemoryResource()
+{
+    static ArrayResource resource;
+    return &resource;
+}
 
-    if (memblock.file_size != size)
+/** Forwards to another resource one call at a time, so resources that aren't thread safe can be used from several threads */
+class SynchronizedResource : public std::pmr::memory_resource
+{
+public:
+    SynchronizedResource(std::pmr::memory_resource* upstream) : upstream(upstream) {}
+
+    std::pmr::memory_resource* getUpstream() const
     {
-        throw std::invalid_argument("Error: Invalid FluxArc");
+        return upstream;
     }
 
-    if (memblock.version != FLUX_ARC_VERSION)
+protected:
+    void* do_allocate(size_t bytes, size_t alignment) override
     {
-        throw std::invalid_argument("Error: Unsupported Flux Arc Version");
+        std::lock_guard<std::mutex> lock(mutex);
+        return upstream->allocate(bytes, alignment);
     }
 
-    if (memblock.magic_number != 5639)
+    void do_deallocate(void* data, size_t bytes, size_t alignment) override
     {
-        throw "Error: Invalid FluxArc";
+        std::lock_guard<std::mutex> lock(mutex);
+        upstream->deallocate(data, bytes, alignment);
     }
 
-    // Load file database
-    database = std::map<std::string, FileHeader>();
-    for (int i = 0; i < memblock.file_quantity; i++)
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
     {
-        FileHeader file;
-        // wf.read((char *)&file, sizeof(FileHeader));
-        wf.read((char*)&file.name_size, sizeof(std::uint32_t));
-        wf.read((char*)&file.compressed, sizeof(bool));
-        wf.read((char*)&file.position, sizeof(uint64_t));
-        wf.read((char*)&file.file_size_uc, sizeof(uint32_t));
-        wf.read((char*)&file.file_size_c, sizeof(uint32_t));
-
-        // Read name
-        char* name = new char[file.name_size];
-        wf.read(name, file.name_size);
-
-        database[std::string(name, file.name_size)] = file;
-
-        delete[] name;
+        return this == &other;
     }
 
-    header = memblock;
+private:
+    std::pmr::memory_resource* upstream;
+    std::mutex mutex;
+};
 
-    if (!dynamic)
+/** Gets a resource that's safe to use from several threads at once, wrapping the given one if it has to be */
+static std::pmr::memory_resource* synchronizedResource(std::pmr::memory_resource* resource)
+{
+    // These are thread safe already
+    if (resource == defaultMemoryResource() || resource == std::pmr::new_delete_resource() || dynamic_cast<SynchronizedResource*>(resource) != nullptr)
     {
-        std::cout << "Allocating file " << filename << "!\n";
-        file_data = std::map<std::string, char* >();
-
-        // Load everything we need from the file
-        for (auto i : database)
-        {
-            auto fname = i.first;
-
-            // Go to location of file
-            wf.seekg(database[fname].position, wf.beg);
-
-            // Load data into buffer
-            char* buffer = new char[database[fname].file_size_c];
-            wf.read(buffer, database[fname].file_size_c);
+        return resource;
+    }
 
-            // Return
-            file_data[fname] = buffer;
-        }
+    // There's one wrapper per resource, so archives that share a resource share its lock. They're never freed,
+    // since memory from them can outlive every archive (in BinaryFiles and views), even at exit
+    static std::mutex wrappers_mutex;
+    static auto* wrappers = new std::map<std::pmr::memory_resource*, std::unique_ptr<SynchronizedResource> >();
 
+    std::lock_guard<std::mutex> lock(wrappers_mutex);
+    auto& wrapper = (*wrappers)[resource];
+    if (!wrapper)
+    {
+        wrapper.reset(new SynchronizedResource(resource));
     }
 
-    // And done!
-    wf.close();
+    return wrapper.get();
 }
 
-Archive::~Archive()
+/** Gets the resource that was given to FluxArc, if it was wrapped by synchronizedResource */
+static std::pmr::memory_resource* givenResource(std::pmr::memory_resource* resource)
 {
-    if (!dynamic)
-    {
-        std::cout << "Deallocating file " << archive_filename << "!\n";
-        // Deallocate stored data
-        for (auto i : file_data)
-        {
-            delete[] i.second;
-        }
-    }
+    auto* wrapper = dynamic_cast<SynchronizedResource*>(resource);
+    return wrapper != nullptr ? wrapper->getUpstream() : resource;
 }
 
-Archive::Archive(const Archive& that)
+std::pmr::memory_resource* BinaryFile::getMemoryResource() const
 {
-    header = that.header;
-    database = that.database;
-    archive_filename = that.archive_filename;
-    dynamic = that.dynamic;
+    return givenResource(resource);
+}
 
-    if (!dynamic)
+/** Gives a buffer back to the memory resource it came from */
+struct ResourceDeleter
+{
+    std::pmr::memory_resource* resource;
+    uint64_t size;
+
+    void operator()(char* data) const
     {
-        // Copy over the file data
-        for (auto i: that.file_data)
-        {
-            auto size = database[i.first].file_size_c;
+        resource->deallocate(data, size, 1);
+    }
+};
 
-            char* buffer = new char[size];
-            memcpy(buffer, that.file_data.at(i.first), size);
+typedef std::unique_ptr<char[], ResourceDeleter> ScratchBuffer;
 
-            file_data[i.first] = buffer;
-        }
-    }
+/** Allocates a buffer that's only needed for a while, like while a file is being copied */
+static ScratchBuffer allocateScratch(uint64_t size, std::pmr::memory_resource* resource)
+{
+    return ScratchBuffer((char*)resource->allocate(size, 1), ResourceDeleter{resource, size});
 }
 
-Archive& Archive::operator=(const Archive& that)
+void FluxArc::parallelFor(size_t count, unsigned int thread_count, const std::function<void(size_t)>& work)
 {
-    if (this != &that)
+    // Every thread takes the next index that hasn't been done yet
+    std::atomic<size_t> next(0);
+    std::exception_ptr error;
+    std::mutex error_mutex;
+
+    auto run = [&]()
     {
-        if (!dynamic)
+        for (size_t i = next++; i < count; i = next++)
         {
-            // Deallocate stuff
-            std::cout << "Assignment: Deallocating " << archive_filename << "!\n";
-
-            // Deallocate stored data
-            for (auto i : file_data)
+            try
             {
-                delete[] i.second;
+                work(i);
             }
-        }
-
-        // Copy in new stuff
-        header = that.header;
-        database = that.database;
-        archive_filename = that.archive_filename;
-        dynamic = that.dynamic;
-
-        if (!dynamic)
-        {
-            // Copy over the file data
-            for (auto i: that.file_data)
+            catch (...)
             {
-                auto size = database[i.first].file_size_c;
-
-                char* buffer = new char[size];
-                memcpy(buffer, that.file_data.at(i.first), size);
-
-                file_data[i.first] = buffer;
+                std::lock_guard<std::mutex> lock(error_mutex);
+                if (!error)
+                {
+                    error = std::current_exception();
+                }
             }
         }
-    }
+    };
 
-    return *this;
-}
+    std::vector<std::thread> threads;
+    thread_count = std::min<size_t>(thread_count, count);
+    for (unsigned int i = 1; i < thread_count; i++)
+    {
+        threads.emplace_back(run);
+    }
+    run();
 
-int Archive::getFileSize(const std::string& fname)
-{
-    if (database.find(fname) == database.end())
+    for (auto& thread : threads)
     {
-        throw std::invalid_argument("Error: File not in archive");
+        thread.join();
     }
 
-    return database[fname].file_size_uc;
+    if (error)
+    {
+        std::rethrow_exception(error);
+    }
 }
 
-int Archive::getFile(const std::string& fname, char* data, bool res_compressed)
+/** Decompresses a single LZ4 block straight into the output */
+static void decompress(const char* data, uint64_t size_c, char* output, uint64_t size)
 {
-    if (database.find(fname) == database.end())
+    int out = LZ4_decompress_safe(data, output, size_c, size);
+
+    if (out < 0 || (uint64_t)out != size)
     {
-        throw std::invalid_argument("Error: File not in archive");
+        throw std::invalid_argument("Error: LZ4 decompression failed");
     }
+}
 
-    if (!dynamic)
+/**
+Compresses data a chunk at a time, handing every finished chunk to output. Returns the compressed size.
+If nanoseconds is given, the time spent in LZ4 is added to it
+*/
+static uint64_t compressChunks(const std::function<void(char*, uint64_t)>& input, uint64_t size, bool release, const std::function<void(const char*, uint64_t)>& output, std::pmr::memory_resource* resource, uint64_t* nanoseconds = nullptr)
+{
+    uint64_t chunk_size = std::min(size, COMPRESSION_CHUNK_SIZE);
+    auto dst_size = LZ4_compressBound(chunk_size);
+
+    // One char = one byte. Remember that
+    auto chunk = allocateScratch(chunk_size, resource);
+    auto compressed = allocateScratch(sizeof(uint32_t) + dst_size, resource);
+
+    uint64_t total = 0;
+    for (uint64_t done = 0; done < size; done += chunk_size)
     {
-        int fs = database[fname].file_size_c;
-        char* x = file_data[fname];
+        chunk_size = std::min(size - done, COMPRESSION_CHUNK_SIZE);
+        input(chunk.get(), chunk_size);
 
-        // Uncompress if needed
-        if (database[fname].compressed && !res_compressed)
+        uint64_t start = nanoseconds ? nowNanoseconds() : 0;
+        int out = 0;
+        if (release)
         {
-            // Remember: X is currently the one and only copy of the data
-            // So make sure not to free it!
-            int out_size;
-            x = decompress(x, database[fname].file_size_c, database[fname].file_size_uc, &out_size, false);
+            // MAXIMUM COMPRESSION!!!!
+            // Also maximum time, but that's not important
+            out = LZ4_compress_HC(chunk.get(), compressed.get() + sizeof(uint32_t), chunk_size, dst_size, LZ4HC_CLEVEL_MAX);
+        }
+        else
+        {
+            out = LZ4_compress_default(chunk.get(), compressed.get() + sizeof(uint32_t), chunk_size, dst_size);
+        }
 
-            if (out_size != database[fname].file_size_uc)
-            {
-                throw std::invalid_argument("Error: Invalid Archive");
-            }
+        if (nanoseconds)
+        {
+            *nanoseconds += nowNanoseconds() - start;
+        }
 
-            fs = database[fname].file_size_uc;
+        if (out == 0)
+        {
+            throw std::invalid_argument("Error: LZ4 compression failed");
         }
 
-        std::memcpy(data, x, fs);
-        return fs;
+        uint32_t block_size = out;
+        std::memcpy(compressed.get(), &block_size, sizeof(uint32_t));
+
+        output(compressed.get(), sizeof(uint32_t) + block_size);
+        total += sizeof(uint32_t) + block_size;
     }
 
-    std::ifstream wf(archive_filename, std::ios::out | std::ios::binary);
+    return total;
+}
 
-    if (!wf)
+/**
+Checks the size of the next chunk of a chunked file. Returns the chunk's decompressed size
+*/
+static uint64_t checkChunk(uint32_t block_size, uint64_t read, uint64_t size_c, uint64_t written, uint64_t size)
+{
+    uint64_t chunk_size = std::min(size - written, COMPRESSION_CHUNK_SIZE);
+    if (read + block_size > size_c || block_size > (uint64_t)LZ4_compressBound(chunk_size))
     {
-        throw std::invalid_argument("Archive has been deleted since it was opened");
+        throw std::invalid_argument("Error: Invalid Archive");
     }
 
-    // Go to location of file
-    wf.seekg(database[fname].position, std::ios::beg);
+    return chunk_size;
+}
 
-    // Load data into buffer
-    char* buffer = new char[database[fname].file_size_c];
-    wf.read(buffer, database[fname].file_size_c);
+/** Decompresses a chunked file that's in memory into output */
+static void decompressChunks(const char* data, uint64_t size_c, char* output, uint64_t size)
+{
+    uint64_t read = 0;
+    uint64_t written = 0;
+    while (written < size)
+    {
+        uint32_t block_size;
+        std::memcpy(&block_size, data + read, sizeof(uint32_t));
+        read += sizeof(uint32_t);
+
+        uint64_t chunk_size = checkChunk(block_size, read, size_c, written, size);
+        decompress(data + read, block_size, output + written, chunk_size);
+
+        read += block_size;
+        written += chunk_size;
+    }
+}
 
-    int fs = database[fname].file_size_c;
+/**
+Decompresses a chunked file into output. input is called with the amount of bytes it has to fill
+the buffer with, and is never asked for more than one chunk.
+If nanoseconds is given, the time spent in LZ4 (but not in input) is added to it
+*/
+static void decompressChunks(const std::function<void(char*, uint64_t)>& input, uint64_t size_c, char* output, uint64_t size, std::pmr::memory_resource* resource, uint64_t* nanoseconds = nullptr)
+{
+    auto block = allocateScratch(LZ4_compressBound(std::min(size, COMPRESSION_CHUNK_SIZE)), resource);
 
-    // Uncompress if needed
-    if (database[fname].compressed && !res_compressed)
+    uint64_t read = 0;
+    uint64_t written = 0;
+    while (written < size)
     {
-        int out_size;
-        buffer = decompress(buffer, database[fname].file_size_c, database[fname].file_size_uc, &out_size);
+        uint32_t block_size;
+        input((char*)&block_size, sizeof(uint32_t));
+        read += sizeof(uint32_t);
+
+        uint64_t chunk_size = checkChunk(block_size, read, size_c, written, size);
+        input(block.get(), block_size);
 
-        if (out_size != database[fname].file_size_uc)
+        uint64_t start = nanoseconds ? nowNanoseconds() : 0;
+        decompress(block.get(), block_size, output + written, chunk_size);
+        if (nanoseconds)
         {
-            throw std::invalid_argument("Error: Invalid Archive");
+            *nanoseconds += nowNanoseconds() - start;
         }
 
-        fs = database[fname].file_size_uc;
+        read += block_size;
+        written += chunk_size;
     }
-
-    // Return
-    std::memcpy(data, buffer, fs);
-
-    delete[] buffer;
-
-    return fs;
 }
 
-std::string Archive::getFile(const std::string& fname)
+/** Reads from a stream, throwing if the data isn't there */
+static void readStream(std::istream& stream, char* buffer, uint64_t size)
 {
-    std::uint32_t size;
-    char* data = new char[getFileSize(fname)];
-    int fsize = getFile(fname, data);
-    
-    // Get size
-    std::memcpy(&size, data, sizeof(std::uint32_t));
+    stream.read(buffer, size);
+    if (!stream || (uint64_t)stream.gcount() != size)
+    {
+        throw std::invalid_argument("Error: Unexpected end of file");
+    }
+}
 
-    // Get data
-    char* out_str = new char[getFileSize(fname) - sizeof(std::uint32_t)];
-    std::memcpy(out_str, data + sizeof(std::uint32_t), getFileSize(fname) - sizeof(std::uint32_t));
+// Bits of the flags byte in a file header
+static const uint8_t FLAG_COMPRESSED = 1;
+static const uint8_t FLAG_REMOVED = 2;
+static const uint8_t FLAG_HIDDEN = 4;
+static const uint8_t FLAG_CHUNKED = 8;
 
-    std::string result(out_str, size);
+/** Gets the size of the archive header in an archive of the given version */
+static uint64_t headerSize(uint16_t version = FLUX_ARC_VERSION)
+{
+    // The alignment was added in version 5, and the volumes in version 6
+    uint64_t size = sizeof(uint16_t) * 2 + sizeof(uint64_t) + sizeof(uint32_t);
+    if (version >= 5)
+    {
+        size += sizeof(uint32_t);
+    }
+    if (version >= 6)
+    {
+        size += sizeof(uint32_t) * 2 + sizeof(uint64_t);
+    }
+    return size;
+}
 
-    delete[] data;
-    delete[] out_str;
+/** Rounds a position up to the next multiple of the alignment */
+static uint64_t alignUp(uint64_t value, uint64_t alignment)
+{
+    return (value + alignment - 1) / alignment * alignment;
+}
 
-    return result;
+/** Starts hashing data that comes a piece at a time */
+static std::shared_ptr<XXH64_state_t> createHashState()
+{
+    std::shared_ptr<XXH64_state_t> state(XXH64_createState(), XXH64_freeState);
+    XXH64_reset(state.get(), 0);
+    return state;
 }
 
-void Archive::setFile(const std::string& fname, char* data, int size, bool compressed, bool compress_release)
+/** Throws if a file's data doesn't match its checksum */
+static void checkChecksum(const FileHeader& fh, uint64_t checksum)
 {
-    if (database.find(fname) != database.end())
+    if (checksum != fh.checksum)
     {
-        // Remove the old one
-        database.erase(fname);
-
-        if (!dynamic)
-        {
-            // Deallocate it's resource
-            delete[] file_data[fname];
-            file_data.erase(fname);
-        }
+        throw std::invalid_argument("Error: File doesn't match its checksum");
     }
-    rebuild(fname, data, size, compressed, compress_release, true);
 }
 
-void Archive::setFile(const std::string& fname, const std::string& data, bool compressed, bool compress_release)
+/** Gets the most space a file can take once it's compressed in chunks */
+static uint64_t compressedBound(uint64_t size)
 {
-    char* buffer = new char[data.size() + sizeof(std::uint32_t)];
-    std::uint32_t size = data.size();
-    std::memcpy(buffer, &size, sizeof(std::uint32_t));
+    uint64_t chunks = (size + COMPRESSION_CHUNK_SIZE - 1) / COMPRESSION_CHUNK_SIZE;
+    return size + chunks * (sizeof(uint32_t) + LZ4_COMPRESSBOUND(COMPRESSION_CHUNK_SIZE) - COMPRESSION_CHUNK_SIZE);
+}
 
-    // Copy in string data
-    std::memcpy(buffer + sizeof(std::uint32_t), data.c_str(), size);
+/** Gets the size of a file header (including the name) in an archive of the given version */
+static uint64_t fileHeaderSize(const std::string& fname, uint16_t version = FLUX_ARC_VERSION)
+{
+    // Sizes were 32 bit before version 4, there were no volumes before version 6 and no checksums before version 7
+    uint64_t size_bytes = version >= 4 ? sizeof(uint64_t) : sizeof(uint32_t);
+    uint64_t volume_bytes = version >= 6 ? sizeof(uint32_t) : 0;
+    uint64_t checksum_bytes = version >= 7 ? sizeof(uint64_t) : 0;
+    return sizeof(uint32_t) + sizeof(uint8_t) + sizeof(uint64_t) + volume_bytes + size_bytes * 2 + checksum_bytes + fname.size();
+}
 
-    // Actually set the file
-    setFile(fname, buffer, size + sizeof(std::uint32_t), compressed, compress_release);
+/** Writes a file header into the buffer. Returns the amount of bytes written */
+static uint64_t serializeFileHeader(char* buffer, const std::string& fname, const FileHeader& fh)
+{
+    uint64_t position = 0;
+    uint8_t flags = (fh.compressed ? FLAG_COMPRESSED : 0) | (fh.removed ? FLAG_REMOVED : 0) | (fh.hidden ? FLAG_HIDDEN : 0) | (fh.chunked ? FLAG_CHUNKED : 0);
+
+    memcpy(buffer + position, &fh.name_size, sizeof(std::uint32_t));
+    position += sizeof(uint32_t);
+    memcpy(buffer + position, &flags, sizeof(uint8_t));
+    position += sizeof(uint8_t);
+    memcpy(buffer + position, &fh.position, sizeof(uint64_t));
+    position += sizeof(uint64_t);
+    memcpy(buffer + position, &fh.volume, sizeof(uint32_t));
+    position += sizeof(uint32_t);
+    memcpy(buffer + position, &fh.file_size_uc, sizeof(uint64_t));
+    position += sizeof(uint64_t);
+    memcpy(buffer + position, &fh.file_size_c, sizeof(uint64_t));
+    position += sizeof(uint64_t);
+    memcpy(buffer + position, &fh.checksum, sizeof(uint64_t));
+    position += sizeof(uint64_t);
+
+    // Write name
+    memcpy(buffer + position, fname.c_str(), fh.name_size);
+    position += fh.name_size;
+
+    return position;
 }
 
-void Archive::rebuild()
+/** Allocates a buffer that can be shared between the archive and its readers, aligned to at least alignment */
+static std::shared_ptr<char> allocateShared(uint64_t size, uint64_t alignment, std::pmr::memory_resource* resource)
 {
-    char x = 'o';
-    rebuild("", &x, 0, false, false, false);
+    char* data = (char*)resource->allocate(size, alignment);
+
+    // The shared_ptr's own bookkeeping comes from the resource too
+    return std::shared_ptr<char>(data, [resource, size, alignment](char* data)
+    {
+        resource->deallocate(data, size, alignment);
+    }, std::pmr::polymorphic_allocator<char>(resource));
 }
 
-void Archive::rebuild(const std::string& fname, char* data, int size, bool compressed, bool compress_release, bool new_file)
+/**
+Decompresses a whole file that's in memory into a new buffer, to be kept as its decompressed copy.
+If it has a checksum, the stored data is checked first, and nullptr is returned if it doesn't match.
+Broken files never get a copy, so reading them always goes through the checks in loadFile
+*/
+static std::shared_ptr<char> decompressFile(const FileHeader& fh, const char* data, uint64_t alignment, std::pmr::memory_resource* resource, bool has_checksum)
 {
-    // Calculate file size
-    int total_size = sizeof(uint16_t) * 2 + sizeof(uint64_t) + sizeof(uint32_t);
-    int header_size = sizeof(uint16_t) * 2 + sizeof(uint64_t) + sizeof(uint32_t);
-    for (auto it : database)
+    if (has_checksum && XXH64(data, fh.file_size_c, 0) != fh.checksum)
     {
-        total_size += it.first.size();
-        total_size += sizeof(uint32_t) * 3 + sizeof(uint64_t) + sizeof(bool);
-        header_size += it.first.size();
-        header_size += sizeof(uint32_t) * 3 + sizeof(uint64_t) + sizeof(bool);
+        return nullptr;
+    }
 
-        total_size += it.second.file_size_c;
+    auto output = allocateShared(fh.file_size_uc, alignment, resource);
+    if (fh.chunked)
+    {
+        decompressChunks(data, fh.file_size_c, output.get(), fh.file_size_uc);
+    }
+    else
+    {
+        decompress(data, fh.file_size_c, output.get(), fh.file_size_uc);
     }
 
-    FileHeader fh;
-    if (new_file)
+    return output;
+}
+
+/** Makes a FileSource that reads from a buffer */
+static std::function<void(char*, uint64_t)> bufferSource(const char* data)
+{
+    auto offset = std::make_shared<uint64_t>(0);
+    return [data, offset](char* buffer, uint64_t size)
     {
-        fh.file_size_uc = size;
-        fh.name_size = fname.size();
-        fh.compressed = compressed;
-        total_size += fname.size();
-        total_size += sizeof(uint32_t) * 3 + sizeof(uint64_t) + sizeof(bool);
-        header_size += fname.size();
-        header_size += sizeof(uint32_t) * 3 + sizeof(uint64_t) + sizeof(bool);
+        std::memcpy(buffer, data + *offset, size);
+        *offset += size;
+    };
+}
 
-        if (compressed)
-        {
-            int out_size;
-            data = compress(data, size, &out_size, compress_release);
-            size = out_size;
-        }
-        else
+/**
+Reads a file from disk a piece at a time. The file is only open while it's being read,
+so adding lots of files doesn't run out of file handles
+*/
+static std::function<void(char*, uint64_t)> fileSource(const std::string& path, uint64_t file_size)
+{
+    auto stream = std::make_shared<std::ifstream>();
+    auto offset = std::make_shared<uint64_t>(0);
+    return [path, file_size, stream, offset](char* buffer, uint64_t size)
+    {
+        if (!stream->is_open())
         {
-            if (!dynamic)
+            stream->open(path, std::ios::in | std::ios::binary);
+            if (!*stream)
             {
-                // Copy the data so we know it won't get freed
-                auto new_data = new char[size];
-                std::memcpy(new_data, data, size);
-                data = new_data;
+                throw std::invalid_argument("Error: Could not open " + path);
             }
         }
 
-        fh.file_size_c = size;
-        total_size += size;
-
-        // Add to database if we're not doing it dynamically
-        if (!dynamic)
+        readStream(*stream, buffer, size);
+        *offset += size;
+        if (*offset >= file_size)
         {
-            file_data[fname] = data;
+            stream->close();
         }
-    }
+    };
+}
 
-    // Build file
-    char* buffer = new char[total_size];
+/** An archive's header and file list, as they're stored in the archive file */
+struct ArchiveIndex
+{
+    Header header;
+    std::map<std::string, FileHeader> database;
+    std::map<std::string, FileHeader> tombstones;
+    std::set<std::string> hidden;
 
-    // Build old content first
-    long long position = header_size;
-    std::map<std::string, FileHeader> new_headers;
-    for (auto it : database)
+    // Where the file list ends
+    uint64_t end;
+};
+
+/** Reads an archive's header and file list from the start of the archive. size is the size of the archive file */
+static ArchiveIndex readIndex(const std::function<void(char*, uint64_t)>& read, uint64_t size)
+{
+    if (size < headerSize(1))
     {
-        char* file_buffer = new char[it.second.file_size_c];
-        int size = getFile(it.first, file_buffer, true);
+        throw std::invalid_argument("Error: File is to small to be a valid FluxArc");
+    }
 
-        if (size != it.second.file_size_c)
-        {
-            throw std::invalid_argument("bad :(");
-        }
+    ArchiveIndex index;
+    Header& memblock = index.header;
 
-        auto new_header = it.second;
-        new_header.position = position;
+    // Get header
+    read((char*)&memblock.magic_number, sizeof(std::uint16_t));
+    read((char*)&memblock.version, sizeof(std::uint16_t));
+    read((char*)&memblock.file_size, sizeof(std::uint64_t));
+    read((char*)&memblock.file_quantity, sizeof(std::uint32_t));
+
+    memblock.alignment = 1;
+    if (memblock.version >= 5)
+    {
+        read((char*)&memblock.alignment, sizeof(std::uint32_t));
+    }
+
+    memblock.volume_count = 1;
+    memblock.generation = 0;
+    memblock.volume_size = 0;
+    if (memblock.version >= 6)
+    {
+        read((char*)&memblock.volume_count, sizeof(std::uint32_t));
+        read((char*)&memblock.generation, sizeof(std::uint32_t));
+        read((char*)&memblock.volume_size, sizeof(std::uint64_t));
+    }
+
+    if (memblock.file_size != size)
+    {
+        throw std::invalid_argument("Error: Invalid FluxArc");
+    }
+
+    if (memblock.version < 1 || memblock.version > FLUX_ARC_VERSION)
+    {
+        throw std::invalid_argument("Error: Unsupported Flux Arc Version");
+    }
+
+    if (memblock.magic_number != 5639)
+    {
+        throw "Error: Invalid FluxArc";
+    }
+
+    // Like setAlignment, anything that isn't a power of 2 can't have come from a real archive
+    if (memblock.alignment == 0 || (memblock.alignment & (memblock.alignment - 1)) != 0)
+    {
+        throw std::invalid_argument("Error: Invalid FluxArc");
+    }
+
+    // Load file database
+    uint64_t index_position = headerSize(memblock.version);
+    for (int i = 0; i < memblock.file_quantity; i++)
+    {
+        FileHeader file;
+        uint8_t flags;
+        read((char*)&file.name_size, sizeof(std::uint32_t));
+        read((char*)&flags, sizeof(uint8_t));
+        read((char*)&file.position, sizeof(uint64_t));
+
+        file.volume = 0;
+        if (memblock.version >= 6)
+        {
+            read((char*)&file.volume, sizeof(uint32_t));
+        }
+
+        if (memblock.version >= 4)
+        {
+            read((char*)&file.file_size_uc, sizeof(uint64_t));
+            read((char*)&file.file_size_c, sizeof(uint64_t));
+        }
+        else
+        {
+            uint32_t size_uc, size_c;
+            read((char*)&size_uc, sizeof(uint32_t));
+            read((char*)&size_c, sizeof(uint32_t));
+            file.file_size_uc = size_uc;
+            file.file_size_c = size_c;
+        }
+
+        file.checksum = 0;
+        if (memblock.version >= 7)
+        {
+            read((char*)&file.checksum, sizeof(uint64_t));
+        }
+
+        file.compressed = flags & FLAG_COMPRESSED;
+        file.removed = flags & FLAG_REMOVED;
+        file.hidden = flags & FLAG_HIDDEN;
+        file.chunked = flags & FLAG_CHUNKED;
+        file.index_position = index_position;
+
+        // Read name
+        if (file.name_size > size)
+        {
+            throw std::invalid_argument("Error: Invalid FluxArc");
+        }
+        std::string fname(file.name_size, '\0');
+        read(&fname[0], file.name_size);
+        index_position += fileHeaderSize(fname, memblock.version);
+
+        if (!file.hidden && file.volume >= memblock.volume_count)
+        {
+            throw std::invalid_argument("Error: Invalid FluxArc");
+        }
+
+        if (file.hidden)
+        {
+            index.hidden.insert(fname);
+        }
+        else if (file.removed)
+        {
+            index.tombstones[fname] = file;
+        }
+        else
+        {
+            index.database[fname] = file;
+        }
+    }
+
+    index.end = index_position;
+    return index;
+}
+
+/** Gets how much data space isn't used by a file (or its padding), which is slack left by in-place overwrites */
+static uint64_t slackBytes(const ArchiveIndex& index, uint64_t total_size)
+{
+    uint64_t used = alignUp(index.end, index.header.alignment);
+    for (auto& i : index.database)
+    {
+        used += alignUp(i.second.file_size_c, index.header.alignment);
+    }
+    for (auto& i : index.tombstones)
+    {
+        used += alignUp(i.second.file_size_c, index.header.alignment);
+    }
+
+    return total_size > used ? total_size - used : 0;
+}
+
+Archive::Archive(const std::string& filename, bool dynamic, unsigned int decompress_threads, std::pmr::memory_resource* resource)
+{
+    this->dynamic = dynamic;
+    this->decompress_threads = decompress_threads;
+    memory_resource = synchronizedResource(resource);
+    archive_filename = filename;
+
+    // Done before the file is opened, so a change made while it's read is seen by refresh()
+    recordDiskState();
+    std::ifstream wf(filename, std::ifstream::ate | std::ios::in | std::ios::binary);
+
+    if (!wf || !wf.good())
+    {
+        // File doesn't exist - new archive
+        header = Header();
+
+        // No idea what this does, or if this works
+        header.magic_number = 5639;
+
+        header.version = FLUX_ARC_VERSION;
+        header.file_size = sizeof(Header);
+        header.file_quantity = 0;
+        header.alignment = 1;
+        header.volume_count = 1;
+        header.generation = 0;
+        header.volume_size = 0;
+        volume_sizes = {header.file_size};
+
+        database = std::map<std::string, FileHeader>();
+        return;
+    }
+
+    // Check file size
+    std::streampos size;
+    size = wf.tellg();
+    wf.seekg(0, wf.beg);
+
+    ArchiveIndex index = readIndex([&wf](char* buffer, uint64_t amount)
+    {
+        readStream(wf, buffer, amount);
+    }, size);
+    const Header& memblock = index.header;
+
+    // The other volumes have to be there too
+    volume_sizes = findVolumes(memblock);
+    uint64_t total_size = 0;
+    for (auto volume_file_size : volume_sizes)
+    {
+        total_size += volume_file_size;
+    }
+
+    slack_bytes = slackBytes(index, total_size);
+    header = memblock;
+    database = std::move(index.database);
+    tombstones = std::move(index.tombstones);
+    hidden = std::move(index.hidden);
+    alignment = memblock.alignment;
+    volume_size = memblock.volume_size;
+
+    if (!dynamic)
+    {
+        std::cout << "Allocating file " << filename << "!\n";
+        file_data = std::map<std::string, std::shared_ptr<char> >();
+
+        // Load each volume's data in one read, from the first file to the end of the last one.
+        // Every file's data is then a view into its volume's slab
+        std::vector<uint64_t> starts(memblock.volume_count, UINT64_MAX);
+        std::vector<uint64_t> ends(memblock.volume_count, 0);
+        for (auto& i : database)
+        {
+            starts[i.second.volume] = std::min(starts[i.second.volume], i.second.position);
+            ends[i.second.volume] = std::max(ends[i.second.volume], i.second.position + i.second.file_size_c);
+        }
+
+        // Volumes are read at the same time, in case they're on different disks
+        std::vector<std::shared_ptr<char> > slabs(memblock.volume_count);
+        parallelFor(memblock.volume_count, memblock.volume_count, [&](size_t volume)
+        {
+            if (ends[volume] <= starts[volume])
+            {
+                return;
+            }
+
+            // Files start at aligned positions, so aligning the slab aligns every file in memory
+            auto slab = allocateShared(ends[volume] - starts[volume], memblock.alignment, resource);
+
+            std::ifstream volume_file = openVolume(volume);
+            volume_file.seekg(starts[volume], std::ios::beg);
+            readStream(volume_file, slab.get(), ends[volume] - starts[volume]);
+
+            slabs[volume] = slab;
+        });
+
+        for (auto& i : database)
+        {
+            // Shares ownership of the slab, so it lives as long as any of its files
+            auto& slab = slabs[i.second.volume];
+            file_data[i.first] = std::shared_ptr<char>(slab, slab.get() + (i.second.position - starts[i.second.volume]));
+        }
+
+        if (decompress_threads > 0)
+        {
+            decompressAll();
+        }
+    }
+
+    // And done!
+    wf.close();
+}
+
+Archive::Archive(std::shared_ptr<const char> data, uint64_t size, unsigned int decompress_threads, std::pmr::memory_resource* resource)
+{
+    dynamic = false;
+    read_only = true;
+    this->decompress_threads = decompress_threads;
+    memory_resource = synchronizedResource(resource);
+
+    // The file list is read straight out of the memory
+    uint64_t offset = 0;
+    ArchiveIndex index = readIndex([&data, size, &offset](char* buffer, uint64_t amount)
+    {
+        if (amount > size - offset)
+        {
+            throw std::invalid_argument("Error: Unexpected end of file");
+        }
+
+        std::memcpy(buffer, data.get() + offset, amount);
+        offset += amount;
+    }, size);
+
+    if (index.header.volume_count != 1)
+    {
+        throw std::invalid_argument("Error: Archives in memory can't be split into volumes");
+    }
+
+    volume_sizes = {size};
+    slack_bytes = slackBytes(index, size);
+    header = index.header;
+    database = std::move(index.database);
+    tombstones = std::move(index.tombstones);
+    hidden = std::move(index.hidden);
+    alignment = header.alignment;
+
+    // Every file's data is a view into the memory, which it keeps alive
+    for (auto& i : database)
+    {
+        if (i.second.position > size || i.second.file_size_c > size - i.second.position)
+        {
+            throw std::invalid_argument("Error: Invalid FluxArc");
+        }
+
+        file_data[i.first] = std::shared_ptr<char>(data, const_cast<char*>(data.get()) + i.second.position);
+    }
+
+    if (decompress_threads > 0)
+    {
+        decompressAll();
+    }
+}
+
+Archive::~Archive()
+{
+    try
+    {
+        waitForCommit();
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << "Error: Background commit failed: " << e.what() << "\n";
+    }
+
+    try
+    {
+        waitForCompaction();
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << "Error: Background compaction failed: " << e.what() << "\n";
+    }
+
+    if (!dynamic && !read_only)
+    {
+        std::cout << "Deallocating file " << archive_filename << "!\n";
+    }
+}
+
+void Archive::decompressAll()
+{
+    std::vector<std::pair<std::string, FileHeader> > to_decompress;
+    for (auto& i : database)
+    {
+        if (i.second.compressed)
+        {
+            to_decompress.push_back(i);
+        }
+    }
+
+    std::vector<std::shared_ptr<char> > results(to_decompress.size());
+    parallelFor(to_decompress.size(), decompress_threads, [&](size_t i)
+    {
+        uint64_t start = isTiming() ? nowNanoseconds() : 0;
+        results[i] = decompressFile(to_decompress[i].second, file_data.at(to_decompress[i].first).get(), header.alignment, memory_resource, header.version >= 7);
+        if (start != 0)
+        {
+            recordEvent(TraceEvent::Decompress, to_decompress[i].first, to_decompress[i].second.file_size_uc, nowNanoseconds() - start);
+        }
+    });
+
+    for (size_t i = 0; i < to_decompress.size(); i++)
+    {
+        if (results[i])
+        {
+            decompressed_data[to_decompress[i].first] = results[i];
+        }
+    }
+}
+
+Archive::Archive(const Archive& that)
+{
+    {
+        // Staged data is never changed, so it's shared instead of copied.
+        // Staging takes state_mutex while holding staging_mutex, so this is done first
+        std::lock_guard<std::mutex> staging_lock(that.staging_mutex);
+        auto_commit = that.auto_commit;
+        staged_files = that.staged_files;
+        staged_removals = that.staged_removals;
+        staged_hides = that.staged_hides;
+        staged_threads = that.staged_threads;
+    }
+
+    std::shared_lock<std::shared_mutex> that_lock(that.state_mutex);
+
+    header = that.header;
+    database = that.database;
+    tombstones = that.tombstones;
+    hidden = that.hidden;
+    archive_filename = that.archive_filename;
+    dynamic = that.dynamic;
+    decompress_threads = that.decompress_threads;
+    compaction_threshold = that.compaction_threshold;
+    background_compaction = that.background_compaction;
+    overwrite_in_place = that.overwrite_in_place;
+    read_only = that.read_only;
+    verify_on_read = that.verify_on_read.load();
+    slack_bytes = that.slack_bytes;
+    alignment = that.alignment;
+    volume_size = that.volume_size;
+    volume_sizes = that.volume_sizes;
+    disk_size = that.disk_size;
+    disk_time = that.disk_time;
+    disk_checked = that.disk_checked;
+    memory_resource = that.memory_resource.load();
+
+    {
+        std::lock_guard<std::mutex> trace_lock(that.trace_mutex);
+        tracing = that.tracing.load();
+        access_trace = that.access_trace;
+        access_counts = that.access_counts;
+        access_successors = that.access_successors;
+        last_access = that.last_access;
+    }
+
+    // File data is never changed in place, so it can be shared instead of copied
+    file_data = that.file_data;
+    decompressed_data = that.decompressed_data;
+}
+
+Archive& Archive::operator=(const Archive& that)
+{
+    if (this != &that)
+    {
+        waitForCommit();
+        waitForCompaction();
+
+        {
+            // Staging takes state_mutex while holding staging_mutex, so this is done first
+            std::scoped_lock staging_lock(staging_mutex, that.staging_mutex);
+            auto_commit = that.auto_commit;
+            staged_files = that.staged_files;
+            staged_removals = that.staged_removals;
+            staged_hides = that.staged_hides;
+            staged_threads = that.staged_threads;
+        }
+
+        std::lock_guard<std::recursive_mutex> write_lock(write_mutex);
+        std::unique_lock<std::shared_mutex> lock(state_mutex);
+        std::shared_lock<std::shared_mutex> that_lock(that.state_mutex);
+
+        if (!dynamic)
+        {
+            std::cout << "Assignment: Deallocating " << archive_filename << "!\n";
+        }
+
+        // Copy in new stuff
+        header = that.header;
+        database = that.database;
+        tombstones = that.tombstones;
+        hidden = that.hidden;
+        archive_filename = that.archive_filename;
+        dynamic = that.dynamic;
+        decompress_threads = that.decompress_threads;
+        compaction_threshold = that.compaction_threshold;
+        background_compaction = that.background_compaction;
+        overwrite_in_place = that.overwrite_in_place;
+        read_only = that.read_only;
+        verify_on_read = that.verify_on_read.load();
+        slack_bytes = that.slack_bytes;
+        alignment = that.alignment;
+        volume_size = that.volume_size;
+        volume_sizes = that.volume_sizes;
+        disk_size = that.disk_size;
+        disk_time = that.disk_time;
+        disk_checked = that.disk_checked;
+        memory_resource = that.memory_resource.load();
+
+        {
+            std::lock_guard<std::mutex> trace_lock(that.trace_mutex);
+            tracing = that.tracing.load();
+            access_trace = that.access_trace;
+            access_counts = that.access_counts;
+            access_successors = that.access_successors;
+            last_access = that.last_access;
+        }
+
+        file_data = that.file_data;
+        decompressed_data = that.decompressed_data;
+    }
+
+    return *this;
+}
+
+static FileInfo makeFileInfo(const std::string& name, const FileHeader& fh)
+{
+    FileInfo info;
+    info.name = name;
+    info.size = fh.file_size_uc;
+    info.stored_size = fh.file_size_c;
+    info.compressed = fh.compressed;
+    info.offset = fh.position;
+    info.volume = fh.volume;
+    info.checksum = fh.checksum;
+    return info;
+}
+
+void Archive::forEachFile(const std::function<void(const FileInfo&)>& callback, const std::string& prefix) const
+{
+    std::shared_lock<std::shared_mutex> lock(state_mutex);
+
+    // The database is sorted, so everything with the prefix is in one run starting at lower_bound
+    for (auto it = database.lower_bound(prefix); it != database.end(); it++)
+    {
+        if (it->first.compare(0, prefix.size(), prefix) != 0)
+        {
+            break;
+        }
+
+        callback(makeFileInfo(it->first, it->second));
+    }
+}
+
+std::vector<FileInfo> Archive::listFiles(const std::string& prefix) const
+{
+    std::vector<FileInfo> output;
+    forEachFile([&output](const FileInfo& info)
+    {
+        output.push_back(info);
+    }, prefix);
+
+    return output;
+}
+
+std::vector<FileInfo> Archive::listDirectory(const std::string& directory, std::vector<std::string>* subdirectories) const
+{
+    std::string prefix = directory;
+    if (!prefix.empty() && prefix.back() != '/')
+    {
+        prefix += '/';
+    }
+
+    std::shared_lock<std::shared_mutex> lock(state_mutex);
+
+    std::vector<FileInfo> output;
+    auto it = database.lower_bound(prefix);
+    while (it != database.end() && it->first.compare(0, prefix.size(), prefix) == 0)
+    {
+        auto slash = it->first.find('/', prefix.size());
+        if (slash == std::string::npos)
+        {
+            output.push_back(makeFileInfo(it->first, it->second));
+            it++;
+            continue;
+        }
+
+        // Sub-directory: report it once, then skip everything inside it.
+        // '0' comes straight after '/', so this lands on the first name past the sub-directory
+        std::string sub = it->first.substr(0, slash);
+        if (subdirectories != nullptr)
+        {
+            subdirectories->push_back(sub.substr(prefix.size()));
+        }
+        it = database.lower_bound(sub + '0');
+    }
+
+    return output;
+}
+
+uint64_t Archive::getFileOffset(const std::string& fname) const
+{
+    std::shared_lock<std::shared_mutex> lock(state_mutex);
+
+    auto found = database.find(fname);
+    if (found == database.end())
+    {
+        throw std::invalid_argument("Error: File not in archive");
+    }
+
+    return found->second.position;
+}
+
+void Archive::setAlignment(uint32_t alignment)
+{
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0)
+    {
+        throw std::invalid_argument("Error: Alignment has to be a power of 2");
+    }
+
+    std::lock_guard<std::recursive_mutex> write_lock(write_mutex);
+    this->alignment = alignment;
+}
+
+void Archive::setMemoryResource(std::pmr::memory_resource* resource)
+{
+    if (resource == nullptr)
+    {
+        throw std::invalid_argument("Error: Memory resource can't be null");
+    }
+
+    memory_resource = synchronizedResource(resource);
+}
+
+std::pmr::memory_resource* Archive::getMemoryResource() const
+{
+    return givenResource(memory_resource);
+}
+
+uint64_t Archive::getFileSize(const std::string& fname)
+{
+    std::shared_lock<std::shared_mutex> lock(state_mutex);
+
+    if (database.find(fname) == database.end())
+    {
+        throw std::invalid_argument("Error: File not in archive");
+    }
+
+    return database[fname].file_size_uc;
+}
+
+uint64_t Archive::getFile(const std::string& fname, char* data, bool res_compressed)
+{
+    uint64_t size = loadFile(fname, data, res_compressed);
+    recordAccess(fname, size);
+
+    return size;
+}
+
+void Archive::recordAccess(const std::string& fname, uint64_t bytes)
+{
+    if (tracing.load(std::memory_order_relaxed))
+    {
+        std::lock_guard<std::mutex> lock(trace_mutex);
+        access_counts[fname]++;
+        if (!last_access.empty() && last_access != fname)
+        {
+            access_successors[last_access][fname]++;
+        }
+        last_access = fname;
+
+        // Only the end of the trace is kept; repack() just needs the counts
+        access_trace.push_back(fname);
+        if (access_trace.size() > ACCESS_TRACE_LIMIT)
+        {
+            access_trace.pop_front();
+        }
+    }
+
+    if (stats_enabled.load(std::memory_order_relaxed))
+    {
+        if (dynamic)
+        {
+            stats.disk_reads.fetch_add(1, std::memory_order_relaxed);
+            stats.disk_read_bytes.fetch_add(bytes, std::memory_order_relaxed);
+        }
+        else
+        {
+            stats.memory_reads.fetch_add(1, std::memory_order_relaxed);
+            stats.memory_read_bytes.fetch_add(bytes, std::memory_order_relaxed);
+        }
+
+        std::shared_lock<std::shared_mutex> lock(state_mutex);
+        auto count = read_counts.find(fname);
+        if (count != read_counts.end())
+        {
+            count->second->fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    if (has_trace_hook.load(std::memory_order_relaxed))
+    {
+        callTraceHook({TraceEvent::Read, fname, bytes, 0, dynamic});
+    }
+}
+
+void Archive::recordEvent(TraceEvent::Type type, const std::string& fname, uint64_t bytes, uint64_t nanoseconds)
+{
+    if (stats_enabled.load(std::memory_order_relaxed))
+    {
+        switch (type)
+        {
+        case TraceEvent::Decompress:
+            stats.decompressions.fetch_add(1, std::memory_order_relaxed);
+            stats.decompressed_bytes.fetch_add(bytes, std::memory_order_relaxed);
+            stats.decompress_nanoseconds.fetch_add(nanoseconds, std::memory_order_relaxed);
+            break;
+        case TraceEvent::Compress:
+            stats.compressions.fetch_add(1, std::memory_order_relaxed);
+            stats.compressed_bytes.fetch_add(bytes, std::memory_order_relaxed);
+            stats.compress_nanoseconds.fetch_add(nanoseconds, std::memory_order_relaxed);
+            break;
+        case TraceEvent::Rebuild:
+            stats.rebuilds.fetch_add(1, std::memory_order_relaxed);
+            stats.rebuild_nanoseconds.fetch_add(nanoseconds, std::memory_order_relaxed);
+            break;
+        case TraceEvent::Read:
+            break;
+        }
+    }
+
+    if (has_trace_hook.load(std::memory_order_relaxed))
+    {
+        callTraceHook({type, fname, bytes, nanoseconds, dynamic});
+    }
+}
+
+void Archive::callTraceHook(const TraceEvent& event)
+{
+    // Keeps the hook alive even if it's replaced during the call
+    auto hook = std::atomic_load(&trace_hook);
+    if (hook)
+    {
+        (*hook)(event);
+    }
+}
+
+void Archive::setTraceHook(TraceHook hook)
+{
+    std::shared_ptr<const TraceHook> new_hook;
+    if (hook)
+    {
+        new_hook = std::make_shared<const TraceHook>(std::move(hook));
+    }
+
+    std::atomic_store(&trace_hook, new_hook);
+    has_trace_hook.store(new_hook != nullptr, std::memory_order_relaxed);
+}
+
+void Archive::setStatsEnabled(bool enabled)
+{
+    if (enabled)
+    {
+        // Every file gets its counter up front, so reads never have to change the map
+        std::unique_lock<std::shared_mutex> lock(state_mutex);
+        for (auto& it : database)
+        {
+            if (read_counts.find(it.first) == read_counts.end())
+            {
+                read_counts.emplace(it.first, std::unique_ptr<std::atomic<uint64_t> >(new std::atomic<uint64_t>(0)));
+            }
+        }
+    }
+
+    stats_enabled.store(enabled, std::memory_order_relaxed);
+}
+
+ArchiveStats Archive::getStats() const
+{
+    ArchiveStats output;
+    output.disk_reads = stats.disk_reads.load(std::memory_order_relaxed);
+    output.disk_read_bytes = stats.disk_read_bytes.load(std::memory_order_relaxed);
+    output.memory_reads = stats.memory_reads.load(std::memory_order_relaxed);
+    output.memory_read_bytes = stats.memory_read_bytes.load(std::memory_order_relaxed);
+    output.decompressions = stats.decompressions.load(std::memory_order_relaxed);
+    output.decompressed_bytes = stats.decompressed_bytes.load(std::memory_order_relaxed);
+    output.decompress_nanoseconds = stats.decompress_nanoseconds.load(std::memory_order_relaxed);
+    output.compressions = stats.compressions.load(std::memory_order_relaxed);
+    output.compressed_bytes = stats.compressed_bytes.load(std::memory_order_relaxed);
+    output.compress_nanoseconds = stats.compress_nanoseconds.load(std::memory_order_relaxed);
+    output.rebuilds = stats.rebuilds.load(std::memory_order_relaxed);
+    output.rebuild_nanoseconds = stats.rebuild_nanoseconds.load(std::memory_order_relaxed);
+
+    return output;
+}
+
+std::map<std::string, uint64_t> Archive::getReadCounts() const
+{
+    std::shared_lock<std::shared_mutex> lock(state_mutex);
+
+    std::map<std::string, uint64_t> output;
+    for (auto& it : read_counts)
+    {
+        uint64_t count = it.second->load(std::memory_order_relaxed);
+        if (count > 0)
+        {
+            output[it.first] = count;
+        }
+    }
+
+    return output;
+}
+
+void Archive::resetStats()
+{
+    stats.disk_reads = 0;
+    stats.disk_read_bytes = 0;
+    stats.memory_reads = 0;
+    stats.memory_read_bytes = 0;
+    stats.decompressions = 0;
+    stats.decompressed_bytes = 0;
+    stats.decompress_nanoseconds = 0;
+    stats.compressions = 0;
+    stats.compressed_bytes = 0;
+    stats.compress_nanoseconds = 0;
+    stats.rebuilds = 0;
+    stats.rebuild_nanoseconds = 0;
+
+    std::shared_lock<std::shared_mutex> lock(state_mutex);
+    for (auto& it : read_counts)
+    {
+        *it.second = 0;
+    }
+}
+
+uint64_t Archive::loadFile(const std::string& fname, char* data, bool res_compressed)
+{
+    std::shared_lock<std::shared_mutex> lock(state_mutex);
+
+    auto found = database.find(fname);
+    if (found == database.end())
+    {
+        throw std::invalid_argument("Error: File not in archive");
+    }
+
+    const FileHeader& fh = found->second;
+    bool decompressing = fh.compressed && !res_compressed;
+    bool verifying = verify_on_read.load(std::memory_order_relaxed) && header.version >= 7;
+
+    if (!dynamic)
+    {
+        const char* x = file_data.at(fname).get();
+
+        if (decompressing)
+        {
+            // Already decompressed when the archive was opened, which is only done for files that match their checksum
+            auto decompressed = decompressed_data.find(fname);
+            if (decompressed != decompressed_data.end())
+            {
+                std::memcpy(data, decompressed->second.get(), fh.file_size_uc);
+                return fh.file_size_uc;
+            }
+        }
+
+        if (verifying)
+        {
+            checkChecksum(fh, XXH64(x, fh.file_size_c, 0));
+        }
+
+        if (!decompressing)
+        {
+            std::memcpy(data, x, fh.file_size_c);
+            return fh.file_size_c;
+        }
+
+        // Remember: X is the one and only copy of the data
+        // So decompress it straight into data
+        uint64_t start = isTiming() ? nowNanoseconds() : 0;
+        if (fh.chunked)
+        {
+            decompressChunks(x, fh.file_size_c, data, fh.file_size_uc);
+        }
+        else
+        {
+            decompress(x, fh.file_size_c, data, fh.file_size_uc);
+        }
+
+        if (start != 0)
+        {
+            recordEvent(TraceEvent::Decompress, fname, fh.file_size_uc, nowNanoseconds() - start);
+        }
+
+        return fh.file_size_uc;
+    }
+
+    std::ifstream wf = openVolume(fh.volume);
+
+    // Go to location of file
+    wf.seekg(fh.position, std::ios::beg);
+    return readFromDisk(fname, fh, wf, data, res_compressed);
+}
+
+uint64_t Archive::readFromDisk(const std::string& fname, const FileHeader& fh, std::istream& wf, char* data, bool res_compressed)
+{
+    bool decompressing = fh.compressed && !res_compressed;
+    bool verifying = verify_on_read.load(std::memory_order_relaxed) && header.version >= 7;
+
+    if (!decompressing)
+    {
+        readStream(wf, data, fh.file_size_c);
+        if (verifying)
+        {
+            checkChecksum(fh, XXH64(data, fh.file_size_c, 0));
+        }
+        return fh.file_size_c;
+    }
+
+    // Only the decompression is timed, not reading from disk
+    bool timing = isTiming();
+    uint64_t nanoseconds = 0;
+    if (fh.chunked)
+    {
+        // Only one chunk is ever in memory, so it's hashed as it's read
+        auto hash_state = verifying ? createHashState() : nullptr;
+        decompressChunks([&wf, &hash_state](char* buffer, uint64_t size)
+        {
+            readStream(wf, buffer, size);
+            if (hash_state)
+            {
+                XXH64_update(hash_state.get(), buffer, size);
+            }
+        }, fh.file_size_c, data, fh.file_size_uc, memory_resource, timing ? &nanoseconds : nullptr);
+
+        if (hash_state)
+        {
+            checkChecksum(fh, XXH64_digest(hash_state.get()));
+        }
+    }
+    else
+    {
+        // Archives from before version 4 store the whole file as one block
+        auto buffer = allocateScratch(fh.file_size_c, memory_resource);
+        readStream(wf, buffer.get(), fh.file_size_c);
+
+        uint64_t start = timing ? nowNanoseconds() : 0;
+        decompress(buffer.get(), fh.file_size_c, data, fh.file_size_uc);
+        nanoseconds = timing ? nowNanoseconds() - start : 0;
+    }
+
+    if (timing)
+    {
+        recordEvent(TraceEvent::Decompress, fname, fh.file_size_uc, nanoseconds);
+    }
+
+    return fh.file_size_uc;
+}
+
+FileReader Archive::openFile(const std::string& fname, bool res_compressed)
+{
+    FileHeader fh;
+    std::unique_ptr<std::istream> stream;
+    std::shared_ptr<const char> memory;
+    bool verifying;
+
+    {
+        std::shared_lock<std::shared_mutex> lock(state_mutex);
+        verifying = verify_on_read.load(std::memory_order_relaxed) && header.version >= 7;
+
+        auto found = database.find(fname);
+        if (found == database.end())
+        {
+            throw std::invalid_argument("Error: File not in archive");
+        }
+        fh = found->second;
+
+        if (dynamic)
+        {
+            // The stream keeps reading the same archive, even if a rebuild swaps in a new one
+            stream.reset(new std::ifstream(openVolume(fh.volume)));
+            stream->seekg(fh.position, std::ios::beg);
+        }
+        else
+        {
+            memory = file_data.at(fname);
+        }
+    }
+
+    bool decompressing = fh.compressed && !res_compressed;
+    recordAccess(fname, decompressing ? fh.file_size_uc : fh.file_size_c);
+
+    return FileReader(fh, decompressing, std::move(stream), memory, memory_resource, verifying);
+}
+
+std::shared_ptr<const char> Archive::getFileView(const std::string& fname)
+{
+    std::shared_ptr<const char> view;
+    uint64_t size;
+    {
+        std::shared_lock<std::shared_mutex> lock(state_mutex);
+
+        auto found = database.find(fname);
+        if (found == database.end())
+        {
+            throw std::invalid_argument("Error: File not in archive");
+        }
+
+        if (dynamic)
+        {
+            return nullptr;
+        }
+
+        size = found->second.file_size_uc;
+        if (!found->second.compressed)
+        {
+            view = file_data.at(fname);
+            if (verify_on_read.load(std::memory_order_relaxed) && header.version >= 7)
+            {
+                checkChecksum(found->second, XXH64(view.get(), size, 0));
+            }
+        }
+        else if (decompressed_data.find(fname) != decompressed_data.end())
+        {
+            // Only files that matched their checksum were decompressed
+            view = decompressed_data.at(fname);
+        }
+        else
+        {
+            // Like loadFile, a broken file throws instead of being skipped
+            if (verify_on_read.load(std::memory_order_relaxed) && header.version >= 7)
+            {
+                checkChecksum(found->second, XXH64(file_data.at(fname).get(), found->second.file_size_c, 0));
+            }
+            return nullptr;
+        }
+    }
+
+    recordAccess(fname, size);
+    return view;
+}
+
+uint64_t Archive::readFile(const std::string& fname, const std::function<bool(const char* data, uint64_t size)>& callback)
+{
+    auto reader = openFile(fname);
+    auto buffer = allocateScratch(std::min(reader.getSize(), COMPRESSION_CHUNK_SIZE), memory_resource);
+
+    uint64_t total = 0;
+    while (!reader.isDone())
+    {
+        uint64_t amount = reader.read(buffer.get(), COMPRESSION_CHUNK_SIZE);
+        total += amount;
+
+        if (!callback(buffer.get(), amount))
+        {
+            break;
+        }
+    }
+
+    return total;
+}
+
+VerifyResult Archive::verify(unsigned int threads)
+{
+    auto start = std::chrono::steady_clock::now();
+    std::shared_lock<std::shared_mutex> lock(state_mutex);
+
+    if (header.version < 7)
+    {
+        throw std::invalid_argument("Error: Archive has no checksums, rebuild it to add them");
+    }
+
+    // Every file, in the order it's stored
+    typedef const std::pair<const std::string, FileHeader>* Entry;
+    std::vector<Entry> files;
+    files.reserve(database.size());
+    for (auto& it : database)
+    {
+        files.push_back(&it);
+    }
+
+    std::sort(files.begin(), files.end(), [](Entry a, Entry b)
+    {
+        return std::make_pair(a->second.volume, a->second.position) < std::make_pair(b->second.volume, b->second.position);
+    });
+
+    // Split them into runs of files next to each other in the same volume, which are checked one run per thread
+    VerifyResult result = {};
+    std::vector<std::pair<size_t, size_t> > runs;
+    uint64_t run_size = 0;
+    for (size_t i = 0; i < files.size(); i++)
+    {
+        if (runs.empty() || run_size >= VERIFY_RUN_SIZE || files[i]->second.volume != files[runs.back().first]->second.volume)
+        {
+            runs.emplace_back(i, i);
+            run_size = 0;
+        }
+
+        runs.back().second = i + 1;
+        run_size += files[i]->second.file_size_c;
+        result.bytes += files[i]->second.file_size_c;
+    }
+
+    std::mutex broken_mutex;
+    parallelFor(runs.size(), threads, [&](size_t run)
+    {
+        std::ifstream wf;
+        uint64_t stream_position = 0;
+        auto buffer = allocateScratch(dynamic ? COPY_BUFFER_SIZE : 0, memory_resource);
+
+        for (size_t i = runs[run].first; i < runs[run].second; i++)
+        {
+            const FileHeader& fh = files[i]->second;
+            bool ok;
+            try
+            {
+                if (!dynamic)
+                {
+                    ok = XXH64(file_data.at(files[i]->first).get(), fh.file_size_c, 0) == fh.checksum;
+                }
+                else
+                {
+                    if (!wf.is_open())
+                    {
+                        wf = openVolume(fh.volume);
+                        wf.seekg(fh.position, std::ios::beg);
+                    }
+                    else if (stream_position != fh.position)
+                    {
+                        wf.clear();
+                        wf.seekg(fh.position, std::ios::beg);
+                    }
+
+                    // If reading fails part way, the next file has to seek
+                    stream_position = UINT64_MAX;
+                    auto hash_state = createHashState();
+                    for (uint64_t done = 0; done < fh.file_size_c; done += COPY_BUFFER_SIZE)
+                    {
+                        uint64_t amount = std::min(COPY_BUFFER_SIZE, fh.file_size_c - done);
+                        readStream(wf, buffer.get(), amount);
+                        XXH64_update(hash_state.get(), buffer.get(), amount);
+                    }
+                    stream_position = fh.position + fh.file_size_c;
+
+                    ok = XXH64_digest(hash_state.get()) == fh.checksum;
+                }
+            }
+            catch (const std::exception&)
+            {
+                ok = false;
+            }
+
+            if (!ok)
+            {
+                std::lock_guard<std::mutex> broken_lock(broken_mutex);
+                result.broken.push_back(files[i]->first);
+            }
+        }
+    });
+
+    std::sort(result.broken.begin(), result.broken.end());
+    result.files = files.size();
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    result.gigabytes_per_second = result.bytes / 1e9 / std::max(result.seconds, 1e-9);
+
+    return result;
+}
+
+FileReader::FileReader(const FileHeader& header, bool decompressing, std::unique_ptr<std::istream> stream, std::shared_ptr<const char> memory, std::pmr::memory_resource* resource, bool verifying)
+    : header(header), decompressing(decompressing), stream(std::move(stream)), memory(memory), block(resource), chunk(resource)
+{
+    if (verifying)
+    {
+        hash_state = createHashState();
+    }
+}
+
+void FileReader::readStored(char* data, uint64_t size)
+{
+    if (stored_read + size > header.file_size_c)
+    {
+        throw std::invalid_argument("Error: Invalid Archive");
+    }
+
+    if (stream)
+    {
+        readStream(*stream, data, size);
+    }
+    else
+    {
+        std::memcpy(data, memory.get() + stored_read, size);
+    }
+
+    stored_read += size;
+
+    if (hash_state)
+    {
+        XXH64_update(hash_state.get(), data, size);
+        if (stored_read == header.file_size_c)
+        {
+            checkChecksum(header, XXH64_digest(hash_state.get()));
+        }
+    }
+}
+
+void FileReader::nextChunk()
+{
+    if (!header.chunked)
+    {
+        // Archives from before version 4 store the whole file as one block,
+        // so all of it has to be decompressed at once
+        block.resize(header.file_size_c);
+        chunk.resize(header.file_size_uc);
+        readStored(block.data(), header.file_size_c);
+        decompress(block.data(), header.file_size_c, chunk.data(), header.file_size_uc);
+        chunk_position = 0;
+        return;
+    }
+
+    uint32_t block_size;
+    readStored((char*)&block_size, sizeof(uint32_t));
+
+    uint64_t chunk_size = checkChunk(block_size, stored_read, header.file_size_c, position, header.file_size_uc);
+    block.resize(block_size);
+    chunk.resize(chunk_size);
+
+    readStored(block.data(), block_size);
+    decompress(block.data(), block_size, chunk.data(), chunk_size);
+    chunk_position = 0;
+}
+
+uint64_t FileReader::read(char* data, uint64_t size)
+{
+    uint64_t total = 0;
+    while (total < size && position < getSize())
+    {
+        uint64_t amount;
+        if (!decompressing)
+        {
+            amount = std::min(size - total, getSize() - position);
+            readStored(data + total, amount);
+        }
+        else
+        {
+            if (chunk_position == chunk.size())
+            {
+                nextChunk();
+            }
+
+            amount = std::min(size - total, (uint64_t)chunk.size() - chunk_position);
+            std::memcpy(data + total, chunk.data() + chunk_position, amount);
+            chunk_position += amount;
+        }
+
+        total += amount;
+        position += amount;
+    }
+
+    return total;
+}
+
+FileStreamBuf::int_type FileStreamBuf::underflow()
+{
+    if (gptr() < egptr())
+    {
+        return traits_type::to_int_type(*gptr());
+    }
+
+    uint64_t amount = reader.read(buffer.data(), buffer.size());
+    if (amount == 0)
+    {
+        return traits_type::eof();
+    }
+
+    setg(buffer.data(), buffer.data(), buffer.data() + amount);
+    return traits_type::to_int_type(*gptr());
+}
+
+std::string Archive::getFile(const std::string& fname)
+{
+    std::uint32_t size;
+    uint64_t file_size = getFileSize(fname);
+    auto data = allocateScratch(file_size, memory_resource);
+    getFile(fname, data.get());
+    
+    // Get size
+    std::memcpy(&size, data.get(), sizeof(std::uint32_t));
+
+    // Get data
+    std::string result(data.get() + sizeof(std::uint32_t), std::min<uint64_t>(size, file_size - sizeof(std::uint32_t)));
+
+    return result;
+}
+
+std::vector<uint64_t> Archive::getFiles(const std::vector<std::string>& fnames, const std::vector<char*>& data, bool res_compressed)
+{
+    if (fnames.size() != data.size())
+    {
+        throw std::invalid_argument("Error: Every file needs a buffer");
+    }
+
+    // Group the files by volume, in the order they're stored, so each volume is read front to back
+    std::vector<std::vector<std::pair<uint64_t, size_t> > > volumes;
+    std::vector<uint64_t> sizes(fnames.size());
+    {
+        // In dynamic archives this is held for the whole read, like verify, so nothing is swapped in or
+        // written in place between grouping the files and reading them. The threads only read, so they
+        // don't take it themselves
+        std::shared_lock<std::shared_mutex> lock(state_mutex);
+        volumes.resize(header.volume_count);
+
+        std::vector<const FileHeader*> headers(fnames.size());
+        for (size_t i = 0; i < fnames.size(); i++)
+        {
+            auto found = database.find(fnames[i]);
+            if (found == database.end())
+            {
+                throw std::invalid_argument("Error: File not in archive");
+            }
+
+            headers[i] = &found->second;
+            volumes[found->second.volume].emplace_back(found->second.position, i);
+        }
+
+        for (auto& files : volumes)
+        {
+            std::sort(files.begin(), files.end());
+        }
+
+        if (dynamic)
+        {
+            // Each volume is opened once and read front to back, only seeking over gaps between the files
+            parallelFor(volumes.size(), volumes.size(), [&](size_t volume)
+            {
+                if (volumes[volume].empty())
+                {
+                    return;
+                }
+
+                std::ifstream wf = openVolume(volume);
+                uint64_t stream_position = UINT64_MAX;
+                for (auto& it : volumes[volume])
+                {
+                    const FileHeader& fh = *headers[it.second];
+                    if (stream_position != fh.position)
+                    {
+                        wf.seekg(fh.position, std::ios::beg);
+                    }
+
+                    sizes[it.second] = readFromDisk(fnames[it.second], fh, wf, data[it.second], res_compressed);
+                    stream_position = fh.position + fh.file_size_c;
+                }
+            });
+        }
+    }
+
+    if (!dynamic)
+    {
+        // Files in memory don't need the order, just the threads
+        parallelFor(volumes.size(), volumes.size(), [&](size_t volume)
+        {
+            for (auto& it : volumes[volume])
+            {
+                sizes[it.second] = getFile(fnames[it.second], data[it.second], res_compressed);
+            }
+        });
+
+        return sizes;
+    }
+
+    // Recording takes state_mutex when stats are on, so it's done once it's let go
+    for (auto& files : volumes)
+    {
+        for (auto& it : files)
+        {
+            recordAccess(fnames[it.second], sizes[it.second]);
+        }
+    }
+
+    return sizes;
+}
+
+void Archive::setFile(const std::string& fname, char* data, uint64_t size, bool compressed, bool compress_release)
+{
+    PendingFile file;
+    file.name = fname;
+    file.source = bufferSource(data);
+    file.size = size;
+    file.compressed = compressed;
+    file.compress_release = compress_release;
+    if (stageFiles({file}))
+    {
+        return;
+    }
+
+    if (overwriteInPlace(file, data))
+    {
+        return;
+    }
+
+    // Rebuild replaces the old version, if there is one
+    std::lock_guard<std::recursive_mutex> write_lock(write_mutex);
+    rebuild(diskOrder(), {file});
+}
+
+void Archive::setFile(const std::string& fname, std::istream& data, uint64_t size, bool compressed, bool compress_release)
+{
+    PendingFile file;
+    file.name = fname;
+    file.source = [&data](char* buffer, uint64_t size)
+    {
+        readStream(data, buffer, size);
+    };
+    file.size = size;
+    file.compressed = compressed;
+    file.compress_release = compress_release;
+    if (stageFiles({file}))
+    {
+        return;
+    }
+
+    std::lock_guard<std::recursive_mutex> write_lock(write_mutex);
+    rebuild(diskOrder(), {file});
+}
+
+
+
+void Archive::setFiles(const std::vector<NewFile>& files, unsigned int threads)
+{
+    std::vector<PendingFile> pending;
+    pending.reserve(files.size());
+    for (auto& file : files)
+    {
+        PendingFile p;
+        p.name = file.name;
+        p.source = file.data != nullptr ? bufferSource(file.data) : fileSource(file.path, file.size);
+        p.size = file.size;
+        p.compressed = file.compressed;
+        p.compress_release = file.compress_release;
+        p.path = file.data != nullptr ? "" : file.path;
+        pending.push_back(p);
+    }
+
+    if (stageFiles(pending, threads))
+    {
+        return;
+    }
+
+    std::lock_guard<std::recursive_mutex> write_lock(write_mutex);
+    rebuild(diskOrder(), pending, threads);
+}
+
+void Archive::setFile(const std::string& fname, const std::string& data, bool compressed, bool compress_release)
+{
+    auto buffer = allocateScratch(data.size() + sizeof(std::uint32_t), memory_resource);
+    std::uint32_t size = data.size();
+    std::memcpy(buffer.get(), &size, sizeof(std::uint32_t));
+
+    // Copy in string data
+    std::memcpy(buffer.get() + sizeof(std::uint32_t), data.c_str(), size);
+
+    // Actually set the file
+    setFile(fname, buffer.get(), size + sizeof(std::uint32_t), compressed, compress_release);
+}
+
+void Archive::rebuild()
+{
+    std::lock_guard<std::recursive_mutex> write_lock(write_mutex);
+
+    rebuild(diskOrder(), {});
+}
+
+void Archive::rebuild(const std::string& fname, char* data, uint64_t size, bool compressed, bool compress_release, bool new_file)
+{
+    std::lock_guard<std::recursive_mutex> write_lock(write_mutex);
+
+    std::vector<PendingFile> files;
+    if (new_file)
+    {
+        PendingFile file;
+        file.name = fname;
+        file.source = bufferSource(data);
+        file.size = size;
+        file.compressed = compressed;
+        file.compress_release = compress_release;
+        files.push_back(file);
+    }
+
+    // Keep the existing layout, so a repack isn't undone by the next change
+    rebuild(diskOrder(), files);
+}
+
+/** Checks if two file headers point at the same stored data */
+static bool sameData(const FileHeader& a, const FileHeader& b)
+{
+    return a.volume == b.volume && a.position == b.position && a.file_size_c == b.file_size_c &&
+        a.file_size_uc == b.file_size_uc && a.checksum == b.checksum && a.compressed == b.compressed && a.chunked == b.chunked;
+}
+
+/** Checks if two file lists have the same files, each pointing at the same data */
+static bool sameFiles(const std::map<std::string, FileHeader>& a, const std::map<std::string, FileHeader>& b)
+{
+    return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin(), [](const std::pair<const std::string, FileHeader>& x, const std::pair<const std::string, FileHeader>& y)
+    {
+        return x.first == y.first && sameData(x.second, y.second);
+    });
+}
+
+bool Archive::refresh()
+{
+    // Archives opened from memory have no file that could change
+    if (archive_filename.empty())
+    {
+        return false;
+    }
+
+    std::lock_guard<std::recursive_mutex> write_lock(write_mutex);
+
+    // Checked before the file is opened, so a change made while it's read is seen next time
+    uint64_t old_size = disk_size;
+    auto old_time = disk_time;
+    auto old_checked = disk_checked;
+    recordDiskState();
+
+    // Modification times are only as fine as the file system's clock tick, so a file that was written just
+    // before it was last checked can be written again without its time changing. Those are read to make sure
+    bool unchanged = disk_size == old_size && disk_time == old_time;
+    bool racy = old_time + std::chrono::seconds(2) >= old_checked;
+    if (unchanged && !racy)
+    {
+        return false;
+    }
+
+    try
+    {
+        std::ifstream wf(archive_filename, std::ifstream::ate | std::ios::in | std::ios::binary);
+        if (!wf)
+        {
+            throw std::invalid_argument("Archive has been deleted since it was opened");
+        }
+
+        uint64_t size = wf.tellg();
+        wf.seekg(0, wf.beg);
+
+        ArchiveIndex index = readIndex([&wf](char* buffer, uint64_t amount)
+        {
+            readStream(wf, buffer, amount);
+        }, size);
+        wf.close();
+
+        std::vector<uint64_t> new_volume_sizes = findVolumes(index.header);
+        uint64_t total_size = 0;
+        for (auto volume_file_size : new_volume_sizes)
+        {
+            total_size += volume_file_size;
+        }
+        uint64_t new_slack = slackBytes(index, total_size);
+
+        if (unchanged && index.header.version == header.version && index.header.generation == header.generation &&
+            index.header.alignment == header.alignment && new_volume_sizes == volume_sizes && index.hidden == hidden &&
+            sameFiles(index.database, database) && sameFiles(index.tombstones, tombstones))
+        {
+            return false;
+        }
+
+        // Files that still point at the same data keep what's already loaded. Without checksums,
+        // the same position doesn't mean the same data, and a new alignment needs new buffers
+        bool keep = index.header.version >= 7 && index.header.alignment == header.alignment;
+        std::map<std::string, std::shared_ptr<char> > new_file_data;
+        std::map<std::string, std::shared_ptr<char> > new_decompressed;
+        std::vector<std::vector<std::pair<std::string, FileHeader> > > changed(index.header.volume_count);
+        for (auto& i : index.database)
+        {
+            auto found = database.find(i.first);
+            if (keep && found != database.end() && sameData(found->second, i.second))
+            {
+                if (file_data.find(i.first) != file_data.end())
+                {
+                    new_file_data[i.first] = file_data.at(i.first);
+                }
+                if (decompressed_data.find(i.first) != decompressed_data.end())
+                {
+                    new_decompressed[i.first] = decompressed_data.at(i.first);
+                }
+            }
+            else if (!dynamic)
+            {
+                changed[i.second.volume].push_back(i);
+            }
+        }
+
+        // Changed files are loaded from every volume at the same time, in the order they're stored
+        std::pmr::memory_resource* resource = memory_resource;
+        std::vector<std::vector<std::shared_ptr<char> > > loaded(changed.size());
+        parallelFor(changed.size(), changed.size(), [&](size_t volume)
+        {
+            auto& files = changed[volume];
+            if (files.empty())
+            {
+                return;
+            }
+
+            std::sort(files.begin(), files.end(), [](const std::pair<std::string, FileHeader>& a, const std::pair<std::string, FileHeader>& b)
+            {
+                return a.second.position < b.second.position;
+            });
+
+            std::ifstream volume_file(volumeFilename(volume, index.header.generation), std::ios::in | std::ios::binary);
+            if (!volume_file)
+            {
+                throw std::invalid_argument("Error: Missing volume " + volumeFilename(volume, index.header.generation));
+            }
+
+            for (auto& file : files)
+            {
+                auto data = allocateShared(file.second.file_size_c, index.header.alignment, resource);
+                volume_file.seekg(file.second.position, std::ios::beg);
+                readStream(volume_file, data.get(), file.second.file_size_c);
+                loaded[volume].push_back(data);
+            }
+        });
+
+        std::vector<std::pair<std::string, FileHeader> > to_decompress;
+        for (size_t volume = 0; volume < changed.size(); volume++)
+        {
+            for (size_t i = 0; i < changed[volume].size(); i++)
+            {
+                new_file_data[changed[volume][i].first] = loaded[volume][i];
+                if (decompress_threads > 0 && changed[volume][i].second.compressed)
+                {
+                    to_decompress.push_back(changed[volume][i]);
+                }
+            }
+        }
+
+        // Keep the steady state a plain copy for the changed files too
+        std::vector<std::shared_ptr<char> > decompressed(to_decompress.size());
+        parallelFor(to_decompress.size(), decompress_threads, [&](size_t i)
+        {
+            uint64_t start = isTiming() ? nowNanoseconds() : 0;
+            decompressed[i] = decompressFile(to_decompress[i].second, new_file_data.at(to_decompress[i].first).get(), index.header.alignment, resource, index.header.version >= 7);
+            if (start != 0)
+            {
+                recordEvent(TraceEvent::Decompress, to_decompress[i].first, to_decompress[i].second.file_size_uc, nowNanoseconds() - start);
+            }
+        });
+
+        for (size_t i = 0; i < to_decompress.size(); i++)
+        {
+            if (decompressed[i])
+            {
+                new_decompressed[to_decompress[i].first] = decompressed[i];
+            }
+        }
+
+        // Everything's loaded, so readers are only held up for the swap
+        std::unique_lock<std::shared_mutex> lock(state_mutex);
+        header = index.header;
+        database = std::move(index.database);
+        tombstones = std::move(index.tombstones);
+        hidden = std::move(index.hidden);
+        file_data = std::move(new_file_data);
+        decompressed_data = std::move(new_decompressed);
+        volume_sizes = new_volume_sizes;
+        slack_bytes = new_slack;
+        alignment = header.alignment;
+        volume_size = header.volume_size;
+
+        if (stats_enabled.load(std::memory_order_relaxed))
+        {
+            for (auto& it : database)
+            {
+                if (read_counts.find(it.first) == read_counts.end())
+                {
+                    read_counts.emplace(it.first, std::unique_ptr<std::atomic<uint64_t> >(new std::atomic<uint64_t>(0)));
+                }
+            }
+        }
+    }
+    catch (...)
+    {
+        // Nothing was swapped in, so the next refresh tries again
+        disk_size = old_size;
+        disk_time = old_time;
+        disk_checked = old_checked;
+        throw;
+    }
+
+    return true;
+}
+
+std::vector<std::string> Archive::diskOrder() const
+{
+    // Sort the positions with pointers to the names, so the sort doesn't look every file up again.
+    // A volume's files come after all the files in the volumes before it
+    typedef std::pair<std::pair<uint32_t, uint64_t>, const std::string*> Position;
+    std::vector<Position> positions;
+    positions.reserve(database.size());
+    for (auto& it : database)
+    {
+        positions.emplace_back(std::make_pair(it.second.volume, it.second.position), &it.first);
+    }
+
+    std::stable_sort(positions.begin(), positions.end(), [](const Position& a, const Position& b)
+    {
+        return a.first < b.first;
+    });
+
+    std::vector<std::string> order;
+    order.reserve(positions.size());
+    for (auto& it : positions)
+    {
+        order.push_back(*it.second);
+    }
+
+    return order;
+}
+
+void Archive::repack()
+{
+    std::map<std::string, uint64_t> access_counts;
+    std::map<std::string, std::map<std::string, uint64_t> > successors;
+    {
+        std::lock_guard<std::mutex> lock(trace_mutex);
+        access_counts = this->access_counts;
+        successors = access_successors;
+    }
+
+    // Hottest files first
+    std::vector<std::string> hot;
+    for (auto& it : access_counts)
+    {
+        if (hasFile(it.first))
+        {
+            hot.push_back(it.first);
+        }
+    }
+
+    std::stable_sort(hot.begin(), hot.end(), [&access_counts](const std::string& a, const std::string& b)
+    {
+        return access_counts.at(a) > access_counts.at(b);
+    });
+
+    // Start a chain at the hottest file that hasn't been placed, then keep following
+    // whichever file was most often read straight after it
+    std::vector<std::string> order;
+    std::set<std::string> placed;
+    for (auto& head : hot)
+    {
+        std::string current = head;
+        while (placed.find(current) == placed.end())
+        {
+            order.push_back(current);
+            placed.insert(current);
+
+            std::string next;
+            uint64_t best = 0;
+            for (auto& it : successors[current])
+            {
+                if (it.second > best && placed.find(it.first) == placed.end() && hasFile(it.first))
+                {
+                    next = it.first;
+                    best = it.second;
+                }
+            }
+
+            if (best == 0)
+            {
+                break;
+            }
+            current = next;
+        }
+    }
+
+    repack(order);
+}
+
+void Archive::repack(const std::vector<std::string>& order)
+{
+    std::lock_guard<std::recursive_mutex> write_lock(write_mutex);
+
+    std::vector<std::string> new_order;
+    std::set<std::string> placed;
+    for (auto& fname : order)
+    {
+        if (hasFile(fname) && placed.insert(fname).second)
+        {
+            new_order.push_back(fname);
+        }
+    }
+
+    // Everything that was never read goes at the back
+    for (auto& fname : diskOrder())
+    {
+        if (placed.insert(fname).second)
+        {
+            new_order.push_back(fname);
+        }
+    }
+
+    rebuild(new_order, {});
+}
+
+void Archive::rebuild(const std::vector<std::string>& order, const std::vector<PendingFile>& files, unsigned int threads, const std::set<std::string>& hides)
+{
+    checkWritable();
+    std::lock_guard<std::recursive_mutex> write_lock(write_mutex);
+    uint64_t rebuild_start = isTiming() ? nowNanoseconds() : 0;
+
+    // If a name is added more than once, the last one wins
+    std::map<std::string, size_t> new_files;
+    for (size_t i = 0; i < files.size(); i++)
+    {
+        new_files[files[i].name] = i;
+    }
+
+    // Files that are being replaced are left out; the new versions go at the end
+    std::vector<std::string> names;
+    for (auto& name : order)
+    {
+        if (new_files.find(name) == new_files.end())
+        {
+            names.push_back(name);
+        }
+    }
+
+    std::set<std::string> new_hidden = hidden;
+    new_hidden.insert(hides.begin(), hides.end());
+    for (auto& it : new_files)
+    {
+        new_hidden.erase(it.first);
+    }
+
+    // Calculate the size of the file list, which comes before the data.
+    // Hidden files are only a file header
+    uint64_t header_size = headerSize();
+    for (auto& name : names)
+    {
+        header_size += fileHeaderSize(name);
+    }
+    for (auto& name : new_hidden)
+    {
+        header_size += fileHeaderSize(name);
+    }
+    for (auto& it : new_files)
+    {
+        header_size += fileHeaderSize(it.first);
+    }
+
+    // Write to a temporary file first, so readers can keep using the old archive until it's swapped in.
+    // The data is written first, and the file list once all the sizes are known
+    // Every writer gets its own temporary file, which is renamed over the archive once it's complete
+    std::string temp_filename = uniqueTempFilename(archive_filename);
+    TempFileGuard temp_guard{{temp_filename}};
+    std::ofstream wf(temp_filename, std::ios::binary | std::ios::out | std::ios::trunc);
+    if (!wf)
+    {
+        throw std::runtime_error("Error: Could not write archive");
+    }
+    // Every file's data starts (and ends) on a multiple of the alignment, with zeros in between
+    uint64_t file_alignment = alignment;
+    uint64_t position = alignUp(header_size, file_alignment);
+    std::vector<char> padding(file_alignment, 0);
+
+    // Data goes into the archive file until it's full, then into the next volume.
+    // The other volumes get new names, so the old ones can still be read until the new file list is swapped in.
+    // The generation is random, so two writers on the same archive never pick the same names
+    uint32_t generation = header.generation;
+    std::random_device random;
+    while (generation == header.generation || std::filesystem::exists(volumeFilename(1, generation)))
+    {
+        generation = random();
+    }
+
+    // Volumes are written to temporary files too, and only get their real names once they're complete
+    std::vector<std::string> temp_volumes;
+    uint64_t max_volume_size = volume_size;
+    uint32_t volume = 0;
+    std::ofstream volume_file;
+    std::ofstream* out = &wf;
+    std::vector<uint64_t> new_volume_sizes;
+
+    auto pad = [&]()
+    {
+        uint64_t aligned = alignUp(position, file_alignment);
+        out->write(padding.data(), aligned - position);
+        position = aligned;
+    };
+
+    // Starts the next volume if a file of this size doesn't fit in the current one.
+    // A file that's bigger than a volume gets one to itself
+    auto fitVolume = [&](uint64_t stored_size)
+    {
+        if (max_volume_size == 0 || position + stored_size <= max_volume_size || (volume > 0 && position == 0))
+        {
+            return;
+        }
+
+        if (volume > 0)
+        {
+            volume_file.close();
+            if (!volume_file)
+            {
+                throw std::runtime_error("Error: Could not write archive");
+            }
+            syncFile(temp_volumes.back());
+        }
+        new_volume_sizes.push_back(position);
+
+        volume++;
+        temp_volumes.push_back(uniqueTempFilename(volumeFilename(volume, generation)));
+        temp_guard.filenames.push_back(temp_volumes.back());
+        volume_file.open(temp_volumes.back(), std::ios::binary | std::ios::out | std::ios::trunc);
+        if (!volume_file)
+        {
+            throw std::runtime_error("Error: Could not write archive");
+        }
+        out = &volume_file;
+        position = 0;
+    };
+
+    wf.seekp(position, std::ios::beg);
+
+    auto copy_buffer = allocateScratch(COPY_BUFFER_SIZE, memory_resource);
+
+    // Build old content first. In dynamic mode it's streamed from the old archive's volumes
+    std::ifstream old_archive;
+    uint32_t old_volume = 0;
+    uint64_t old_position = 0;
+    // Archives from before version 7 get their checksums as their data is copied
+    bool add_checksums = header.version < 7;
+    std::map<std::string, FileHeader> new_headers;
+    for (auto& name : names)
+    {
+        auto new_header = database.at(name);
+        fitVolume(new_header.file_size_c);
+        auto hash_state = add_checksums ? createHashState() : nullptr;
+
+        if (dynamic)
+        {
+            if (!old_archive.is_open() || old_volume != new_header.volume)
+            {
+                old_archive = openVolume(new_header.volume);
+                old_volume = new_header.volume;
+                old_position = 0;
+            }
+
+            // Files are usually copied in the order they're stored, so only seek if there's a gap.
+            // Seeking throws away the stream's buffer, which is slow with lots of small files
+            if (old_position != new_header.position)
+            {
+                old_archive.seekg(new_header.position, std::ios::beg);
+            }
+            old_position = new_header.position + new_header.file_size_c;
+            for (uint64_t done = 0; done < new_header.file_size_c; done += COPY_BUFFER_SIZE)
+            {
+                uint64_t amount = std::min(COPY_BUFFER_SIZE, new_header.file_size_c - done);
+                readStream(old_archive, copy_buffer.get(), amount);
+                out->write(copy_buffer.get(), amount);
+                if (hash_state)
+                {
+                    XXH64_update(hash_state.get(), copy_buffer.get(), amount);
+                }
+            }
+        }
+        else
+        {
+            out->write(file_data.at(name).get(), new_header.file_size_c);
+            if (hash_state)
+            {
+                XXH64_update(hash_state.get(), file_data.at(name).get(), new_header.file_size_c);
+            }
+        }
+
+        if (hash_state)
+        {
+            new_header.checksum = XXH64_digest(hash_state.get());
+        }
+
+        new_header.volume = volume;
+        new_header.position = position;
+        position += new_header.file_size_c;
+        pad();
 
         // Make sure to copy string
-        new_headers.emplace(std::string(it.first), new_header);
+        new_headers.emplace(std::string(name), new_header);
+    }
+
+    // Build new content, in the order the files were given.
+    // If we're not doing it dynamically, it's kept in memory as well
+    std::map<std::string, std::shared_ptr<char> > new_data;
+    auto addFile = [&](const PendingFile& file, const std::pmr::vector<char>* prepared, uint64_t prepared_checksum)
+    {
+        // Compressed files that are streamed aren't compressed yet, so they have to fit at their worst
+        fitVolume(prepared != nullptr ? prepared->size() : file.compressed ? compressedBound(file.size) : file.size);
+
+        FileHeader fh = {};
+        fh.name_size = file.name.size();
+        fh.compressed = file.compressed;
+        fh.chunked = file.compressed;
+        fh.volume = volume;
+        fh.position = position;
+        fh.file_size_uc = file.size;
+
+        std::shared_ptr<char> data;
+        if (prepared != nullptr)
+        {
+            // Already read (and compressed) by prepareFile
+            out->write(prepared->data(), prepared->size());
+            fh.file_size_c = prepared->size();
+            fh.checksum = prepared_checksum;
+
+            if (!dynamic)
+            {
+                data = allocateShared(prepared->size(), file_alignment, memory_resource);
+                std::memcpy(data.get(), prepared->data(), prepared->size());
+            }
+        }
+        else if (file.compressed)
+        {
+            std::pmr::vector<char> kept(memory_resource.load());
+            auto hash_state = createHashState();
+            bool timing = isTiming();
+            uint64_t nanoseconds = 0;
+            fh.file_size_c = compressChunks(file.source, file.size, file.compress_release, [&](const char* chunk, uint64_t chunk_size)
+            {
+                out->write(chunk, chunk_size);
+                XXH64_update(hash_state.get(), chunk, chunk_size);
+                if (!dynamic)
+                {
+                    kept.insert(kept.end(), chunk, chunk + chunk_size);
+                }
+            }, memory_resource, timing ? &nanoseconds : nullptr);
+            fh.checksum = XXH64_digest(hash_state.get());
+
+            if (timing)
+            {
+                recordEvent(TraceEvent::Compress, file.name, file.size, nanoseconds);
+            }
+
+            if (!dynamic)
+            {
+                data = allocateShared(kept.size(), file_alignment, memory_resource);
+                std::memcpy(data.get(), kept.data(), kept.size());
+            }
+        }
+        else if (!dynamic)
+        {
+            // Copy the data so we know it won't get freed
+            data = allocateShared(file.size, file_alignment, memory_resource);
+            file.source(data.get(), file.size);
+            out->write(data.get(), file.size);
+            fh.file_size_c = file.size;
+            fh.checksum = XXH64(data.get(), file.size, 0);
+        }
+        else
+        {
+            auto hash_state = createHashState();
+            for (uint64_t done = 0; done < file.size; done += COPY_BUFFER_SIZE)
+            {
+                uint64_t amount = std::min(COPY_BUFFER_SIZE, file.size - done);
+                file.source(copy_buffer.get(), amount);
+                out->write(copy_buffer.get(), amount);
+                XXH64_update(hash_state.get(), copy_buffer.get(), amount);
+            }
+            fh.file_size_c = file.size;
+            fh.checksum = XXH64_digest(hash_state.get());
+        }
+
+        position += fh.file_size_c;
+        pad();
+
+        // Add to database for header creation
+        new_headers[file.name] = fh;
+        if (!dynamic)
+        {
+            new_data[file.name] = data;
+        }
+    };
+
+    std::vector<size_t> to_add;
+    for (size_t i = 0; i < files.size(); i++)
+    {
+        if (new_files[files[i].name] == i)
+        {
+            to_add.push_back(i);
+        }
+    }
+
+    for (size_t next = 0; next < to_add.size();)
+    {
+        // Small files are read and compressed in parallel a batch at a time, then written in order.
+        // Anything bigger than a batch is streamed on this thread instead
+        std::vector<size_t> batch;
+        uint64_t batch_size = 0;
+        while (threads > 1 && next < to_add.size() && !files[to_add[next]].prepared && batch_size + files[to_add[next]].size <= PARALLEL_BATCH_SIZE)
+        {
+            batch_size += files[to_add[next]].size;
+            batch.push_back(to_add[next]);
+            next++;
+        }
+
+        if (batch.empty())
+        {
+            // Files that are already compressed are written as they are
+            auto& prepared = files[to_add[next]].prepared;
+            addFile(files[to_add[next]], prepared.get(), prepared ? XXH64(prepared->data(), prepared->size(), 0) : 0);
+            next++;
+            continue;
+        }
+
+        std::vector<std::pmr::vector<char> > prepared(batch.size());
+        std::vector<uint64_t> checksums(batch.size());
+        parallelFor(batch.size(), threads, [&](size_t i)
+        {
+            prepared[i] = prepareFile(files[batch[i]]);
+            checksums[i] = XXH64(prepared[i].data(), prepared[i].size(), 0);
+        });
+
+        for (size_t i = 0; i < batch.size(); i++)
+        {
+            addFile(files[batch[i]], &prepared[i], checksums[i]);
+        }
+    }
+
+    new_volume_sizes.push_back(position);
+    if (volume > 0)
+    {
+        volume_file.close();
+        if (!volume_file)
+        {
+            throw std::runtime_error("Error: Could not write archive");
+        }
+        syncFile(temp_volumes.back());
+    }
+
+    // Build headers
+    Header h;
+    h.file_quantity = new_headers.size() + new_hidden.size();
+    h.file_size = new_volume_sizes[0];
+    h.magic_number = 5639;
+    h.version = FLUX_ARC_VERSION;
+    h.alignment = file_alignment;
+    h.volume_count = volume + 1;
+    h.generation = generation;
+    h.volume_size = max_volume_size;
+
+    std::unique_ptr<char[]> buffer(new char[header_size]);
+    position = 0;
+
+    memcpy(buffer.get() + position, &h.magic_number, sizeof(uint16_t));
+    position += sizeof(uint16_t);
+    memcpy(buffer.get() + position, &h.version, sizeof(uint16_t));
+    position += sizeof(uint16_t);
+    memcpy(buffer.get() + position, &h.file_size, sizeof(uint64_t));
+    position += sizeof(uint64_t);
+    memcpy(buffer.get() + position, &h.file_quantity, sizeof(uint32_t));
+    position += sizeof(uint32_t);
+    memcpy(buffer.get() + position, &h.alignment, sizeof(uint32_t));
+    position += sizeof(uint32_t);
+    memcpy(buffer.get() + position, &h.volume_count, sizeof(uint32_t));
+    position += sizeof(uint32_t);
+    memcpy(buffer.get() + position, &h.generation, sizeof(uint32_t));
+    position += sizeof(uint32_t);
+    memcpy(buffer.get() + position, &h.volume_size, sizeof(uint64_t));
+    position += sizeof(uint64_t);
+
+    // File headers
+    for (auto& it: new_headers)
+    {
+        it.second.index_position = position;
+        position += serializeFileHeader(buffer.get() + position, it.first, it.second);
+    }
+
+    for (auto& name : new_hidden)
+    {
+        FileHeader hidden_header = {};
+        hidden_header.name_size = name.size();
+        hidden_header.hidden = true;
+        position += serializeFileHeader(buffer.get() + position, name, hidden_header);
+    }
+
+    if (position != header_size) std::cerr << "Error: File sizes broken" << std::endl;
+
+    // The padding after the file list is written too, in case there's no data after it
+    wf.seekp(0, std::ios::beg);
+    wf.write(buffer.get(), header_size);
+    wf.write(padding.data(), alignUp(header_size, file_alignment) - header_size);
+    wf.close();
+
+    if (!wf)
+    {
+        throw std::runtime_error("Error: Could not write archive");
+    }
+
+    // Everything has to be on the disk before the rename, or a power loss could leave a renamed but empty archive
+    syncFile(temp_filename);
+
+    // The volumes get their real names first, and are only kept if the archive file is renamed too
+    TempFileGuard volume_guard;
+    for (uint32_t i = 1; i <= temp_volumes.size(); i++)
+    {
+        std::filesystem::rename(temp_volumes[i - 1], volumeFilename(i, generation));
+        volume_guard.filenames.push_back(volumeFilename(i, generation));
+    }
+    if (!temp_volumes.empty())
+    {
+        syncDirectory(std::filesystem::path(archive_filename).parent_path());
+    }
+
+    // Keep the steady state a plain copy for the new files too
+    std::map<std::string, std::shared_ptr<char> > new_decompressed;
+    if (decompress_threads > 0)
+    {
+        for (auto& it : new_data)
+        {
+            auto& fh = new_headers.at(it.first);
+            if (fh.compressed)
+            {
+                uint64_t start = isTiming() ? nowNanoseconds() : 0;
+                auto decompressed = decompressFile(fh, it.second.get(), file_alignment, memory_resource, true);
+                if (decompressed)
+                {
+                    new_decompressed[it.first] = decompressed;
+                }
+                if (start != 0)
+                {
+                    recordEvent(TraceEvent::Decompress, it.first, fh.file_size_uc, nowNanoseconds() - start);
+                }
+            }
+        }
+    }
+
+    Header old_header;
+    {
+        std::unique_lock<std::shared_mutex> lock(state_mutex);
+        std::filesystem::rename(temp_filename, archive_filename);
+        volume_guard.filenames.clear();
+        recordDiskState();
+        old_header = header;
+
+        for (auto& it : new_data)
+        {
+            file_data[it.first] = it.second;
+            decompressed_data.erase(it.first);
+        }
+        for (auto& it : new_decompressed)
+        {
+            decompressed_data[it.first] = it.second;
+        }
+
+        header = h;
+        database = new_headers;
+        tombstones.clear();
+        hidden = new_hidden;
+        slack_bytes = 0;
+        volume_sizes = new_volume_sizes;
+
+        // Drop the data of files that are gone
+        for (auto it = file_data.begin(); it != file_data.end();)
+        {
+            it = database.find(it->first) == database.end() ? file_data.erase(it) : std::next(it);
+        }
+        for (auto it = decompressed_data.begin(); it != decompressed_data.end();)
+        {
+            it = database.find(it->first) == database.end() ? decompressed_data.erase(it) : std::next(it);
+        }
+
+        if (stats_enabled.load(std::memory_order_relaxed))
+        {
+            for (auto& it : database)
+            {
+                if (read_counts.find(it.first) == read_counts.end())
+                {
+                    read_counts.emplace(it.first, std::unique_ptr<std::atomic<uint64_t> >(new std::atomic<uint64_t>(0)));
+                }
+            }
+        }
+    }
+
+    // The rename has to be on the disk before the old volumes are gone, or a power loss could bring back
+    // the old file list without its data
+    syncDirectory(std::filesystem::path(archive_filename).parent_path());
+
+    // Nothing reads the old volumes any more, other than FileReaders that already have them open
+    for (uint32_t i = 1; i < old_header.volume_count; i++)
+    {
+        std::error_code error;
+        std::filesystem::remove(volumeFilename(i, old_header.generation), error);
+    }
+
+    if (rebuild_start != 0)
+    {
+        uint64_t total_size = 0;
+        for (auto size : new_volume_sizes)
+        {
+            total_size += size;
+        }
+        recordEvent(TraceEvent::Rebuild, "", total_size, nowNanoseconds() - rebuild_start);
+    }
+}
+
+std::pmr::vector<char> Archive::prepareFile(const PendingFile& file)
+{
+    std::pmr::vector<char> output(memory_resource.load());
+    if (!file.compressed)
+    {
+        output.resize(file.size);
+        file.source(output.data(), file.size);
+        return output;
+    }
+
+    bool timing = isTiming();
+    uint64_t nanoseconds = 0;
+    compressChunks(file.source, file.size, file.compress_release, [&output](const char* chunk, uint64_t chunk_size)
+    {
+        output.insert(output.end(), chunk, chunk + chunk_size);
+    }, memory_resource, timing ? &nanoseconds : nullptr);
+
+    if (timing)
+    {
+        recordEvent(TraceEvent::Compress, file.name, file.size, nanoseconds);
+    }
+
+    return output;
+}
+
+bool Archive::overwriteInPlace(PendingFile& file, const char* data)
+{
+    std::lock_guard<std::recursive_mutex> write_lock(write_mutex);
+    const std::string& fname = file.name;
+    uint64_t size = file.size;
+    bool compressed = file.compressed;
+
+    // The file header has to be in the current format to be changed in place
+    auto found = database.find(fname);
+    if (!overwrite_in_place || header.version != FLUX_ARC_VERSION || found == database.end())
+    {
+        return false;
+    }
+
+    // The file can use everything up to the next file's data in its volume, even if that file's been removed.
+    // Empty files can share their position with the file after them
+    FileHeader fh = found->second;
+    uint64_t end = volume_sizes.at(fh.volume);
+    for (auto* files : {&database, &tombstones})
+    {
+        for (auto& it : *files)
+        {
+            if (&it.second == &found->second || it.second.volume != fh.volume)
+            {
+                continue;
+            }
+
+            if (it.second.position > fh.position || (it.second.position == fh.position && it.second.file_size_c > 0))
+            {
+                end = std::min(end, it.second.position);
+            }
+        }
+    }
+    uint64_t capacity = end - fh.position;
+
+    if (size > capacity && !compressed)
+    {
+        return false;
+    }
 
-        if (position + it.second.file_size_c > total_size)
+    const char* stored = data;
+    uint64_t stored_size = size;
+    if (compressed)
+    {
+        auto compressed_data = std::make_shared<std::pmr::vector<char> >(memory_resource.load());
+        bool timing = isTiming();
+        uint64_t nanoseconds = 0;
+        compressChunks(bufferSource(data), size, file.compress_release, [&compressed_data](const char* chunk, uint64_t chunk_size)
         {
-            std::cerr << "Error: Sizes broke\n";
-        }
+            compressed_data->insert(compressed_data->end(), chunk, chunk + chunk_size);
+        }, memory_resource, timing ? &nanoseconds : nullptr);
 
-        memcpy(buffer + position, file_buffer, it.second.file_size_c);
+        if (timing)
+        {
+            recordEvent(TraceEvent::Compress, fname, size, nanoseconds);
+        }
 
-        position += it.second.file_size_c;
+        // Kept, so a rebuild can use it if it doesn't fit
+        file.prepared = compressed_data;
+        stored = compressed_data->data();
+        stored_size = compressed_data->size();
+    }
 
-        delete[] file_buffer;
-        file_buffer = nullptr;
+    if (stored_size > capacity)
+    {
+        return false;
     }
 
-    database = new_headers;
+    uint64_t old_size = fh.file_size_c;
+    fh.compressed = compressed;
+    fh.chunked = compressed;
+    fh.file_size_uc = size;
+    fh.file_size_c = stored_size;
+    fh.checksum = XXH64(stored, stored_size, 0);
 
-    if (new_file)
+    // Keep the in-memory copy (and the decompressed one) up to date as well
+    std::shared_ptr<char> new_data;
+    std::shared_ptr<char> new_decompressed;
+    if (!dynamic)
     {
-        if (position != total_size - fh.file_size_c) std::cerr << "Error: File sizes broken" << std::endl;
-        // Build new content
-        fh.position = position;
-        memcpy(buffer + position, data, fh.file_size_c);
+        new_data = allocateShared(stored_size, header.alignment, memory_resource);
+        std::memcpy(new_data.get(), stored, stored_size);
 
-        // Add to database for header creation
-        database[fname] = fh;
+        if (compressed && decompress_threads > 0)
+        {
+            new_decompressed = decompressFile(fh, new_data.get(), header.alignment, memory_resource, true);
+        }
     }
 
-    // Build headers
-    position = 0;
-    Header h;
-    h.file_quantity = database.size();
-    h.file_size = total_size;
-    h.magic_number = 5639;
-    h.version = FLUX_ARC_VERSION;
+    {
+        // Readers read under the shared lock, so nobody sees the file half written
+        std::unique_lock<std::shared_mutex> lock(state_mutex);
 
-    header = h;
+        std::fstream wf(volumeFilename(fh.volume, header.generation), std::ios::binary | std::ios::in | std::ios::out);
+        if (!wf)
+        {
+            throw std::invalid_argument("Archive has been deleted since it was opened");
+        }
 
-    memcpy(buffer + position, &h.magic_number, sizeof(uint16_t));
-    position += sizeof(uint16_t);
-    memcpy(buffer + position, &h.version, sizeof(uint16_t));
-    position += sizeof(uint16_t);
-    memcpy(buffer + position, &h.file_size, sizeof(uint64_t));
-    position += sizeof(uint64_t);
-    memcpy(buffer + position, &h.file_quantity, sizeof(uint32_t));
-    position += sizeof(uint32_t);
+        wf.seekp(fh.position, std::ios::beg);
+        wf.write(stored, stored_size);
+        wf.close();
 
-    // position += header_size;
+        if (!wf)
+        {
+            throw std::runtime_error("Error: Could not write archive");
+        }
 
-    // File headers
-    for (auto it: database)
-    {
-        // Write header
-        // memcpy(buffer + position, &it.second, sizeof(FileHeader));
-        // position += sizeof(FileHeader);
-        memcpy(buffer + position, &it.second.name_size, sizeof(std::uint32_t));
-        position += sizeof(uint32_t);
-        memcpy(buffer + position, &it.second.compressed, sizeof(bool));
-        position += sizeof(bool);
-        memcpy(buffer + position, &it.second.position, sizeof(uint64_t));
-        position += sizeof(uint64_t);
-        memcpy(buffer + position, &it.second.file_size_uc, sizeof(uint32_t));
-        position += sizeof(uint32_t);
-        memcpy(buffer + position, &it.second.file_size_c, sizeof(uint32_t));
-        position += sizeof(uint32_t);
-
-        // Write name
-        memcpy(buffer + position, it.first.c_str(), it.second.name_size);
-        position += it.second.name_size;
+        // Only the file's own header changes
+        writeFileHeader(fname, fh);
+
+        database[fname] = fh;
+        // Padding up to the alignment isn't slack
+        slack_bytes = slack_bytes + alignUp(old_size, header.alignment) - alignUp(stored_size, header.alignment);
+
+        if (!dynamic)
+        {
+            file_data[fname] = new_data;
+            decompressed_data.erase(fname);
+            if (new_decompressed)
+            {
+                decompressed_data[fname] = new_decompressed;
+            }
+        }
     }
 
-    if (position != header_size) std::cerr << "Error: File sizes broken" << std::endl;
+    return true;
+}
+
+void Archive::writeFileHeader(const std::string& fname, const FileHeader& fh)
+{
+    checkWritable();
+    char* buffer = new char[fileHeaderSize(fname)];
+    uint64_t size = serializeFileHeader(buffer, fname, fh);
+
+    std::fstream wf(archive_filename, std::ios::binary | std::ios::in | std::ios::out);
+    if (!wf)
+    {
+        delete[] buffer;
+        throw std::invalid_argument("Archive has been deleted since it was opened");
+    }
 
-    // Now actually write it to a file
-    std::ofstream wf(archive_filename, std::ios::binary | std::ios::out);
-    wf.write(buffer, total_size);
+    wf.seekp(fh.index_position, std::ios::beg);
+    wf.write(buffer, size);
     wf.close();
 
     delete[] buffer;
-    buffer = nullptr;
 
-    if (compressed && dynamic)
+    if (!wf)
+    {
+        throw std::runtime_error("Error: Could not write archive");
+    }
+
+    // The file's data is always written first, so this covers in-place overwrites too
+    recordDiskState();
+}
+
+void Archive::checkWritable() const
+{
+    if (read_only)
+    {
+        throw std::invalid_argument("Error: Archive is read only");
+    }
+}
+
+std::string Archive::volumeFilename(uint32_t volume, uint32_t generation) const
+{
+    if (volume == 0)
+    {
+        return archive_filename;
+    }
+
+    // e.g. "game.farc.v1.3" is volume 1 of the archive written by the 3rd rebuild
+    return archive_filename + ".v" + std::to_string(volume) + "." + std::to_string(generation);
+}
+
+std::vector<uint64_t> Archive::findVolumes(const Header& h) const
+{
+    std::vector<uint64_t> sizes = {h.file_size};
+    for (uint32_t i = 1; i < h.volume_count; i++)
+    {
+        std::error_code error;
+        uint64_t volume_file_size = std::filesystem::file_size(volumeFilename(i, h.generation), error);
+        if (error)
+        {
+            throw std::invalid_argument("Error: Missing volume " + volumeFilename(i, h.generation));
+        }
+
+        sizes.push_back(volume_file_size);
+    }
+
+    return sizes;
+}
+
+void Archive::recordDiskState()
+{
+    std::error_code size_error, time_error;
+    disk_size = std::filesystem::file_size(archive_filename, size_error);
+    disk_time = std::filesystem::last_write_time(archive_filename, time_error);
+    disk_checked = std::filesystem::file_time_type::clock::now();
+
+    // A missing file is remembered as empty, so it's seen when it comes back
+    if (size_error || time_error)
+    {
+        disk_size = 0;
+        disk_time = std::filesystem::file_time_type();
+    }
+}
+
+std::ifstream Archive::openVolume(uint32_t volume) const
+{
+    std::ifstream wf(volumeFilename(volume, header.generation), std::ios::in | std::ios::binary);
+    if (!wf)
+    {
+        throw std::invalid_argument("Archive has been deleted since it was opened");
+    }
+
+    return wf;
+}
+
+bool Archive::stageFiles(const std::vector<PendingFile>& files, unsigned int threads)
+{
+    checkWritable();
+    std::lock_guard<std::mutex> lock(staging_mutex);
+    if (auto_commit)
+    {
+        return false;
+    }
+
+    for (auto& file : files)
+    {
+        // Keep the data until it's committed, unless it can be read from disk again
+        PendingFile staged = file;
+        if (staged.path.empty())
+        {
+            staged.copy = std::make_shared<std::pmr::vector<char> >(file.size, memory_resource.load());
+            file.source(staged.copy->data(), file.size);
+        }
+        staged.source = nullptr;
+
+        // Only the last version of a file is kept
+        staged_files.erase(std::remove_if(staged_files.begin(), staged_files.end(), [&file](const PendingFile& other)
+        {
+            return other.name == file.name;
+        }), staged_files.end());
+        staged_removals.erase(file.name);
+        staged_hides.erase(file.name);
+
+        staged_files.push_back(staged);
+    }
+
+    staged_threads = std::max(staged_threads, threads);
+    return true;
+}
+
+bool Archive::stageRemoval(const std::string& fname, bool hide)
+{
+    checkWritable();
+    std::lock_guard<std::mutex> lock(staging_mutex);
+    if (auto_commit)
+    {
+        return false;
+    }
+
+    auto staged = std::remove_if(staged_files.begin(), staged_files.end(), [&fname](const PendingFile& file)
+    {
+        return file.name == fname;
+    });
+    bool was_staged = staged != staged_files.end();
+    staged_files.erase(staged, staged_files.end());
+
+    if (hide)
+    {
+        staged_hides.insert(fname);
+        return true;
+    }
+
+    // Files that are being committed right now will be in the archive by the next commit
+    bool exists = hasFile(fname) || committing.find(fname) != committing.end();
+    if (!exists && !was_staged)
+    {
+        throw std::invalid_argument("Error: File not in archive");
+    }
+
+    if (exists)
+    {
+        staged_removals.insert(fname);
+    }
+
+    return true;
+}
+
+void Archive::setAutoCommit(bool enabled)
+{
+    {
+        std::lock_guard<std::mutex> lock(staging_mutex);
+        auto_commit = enabled;
+    }
+
+    if (enabled)
+    {
+        commit();
+    }
+}
+
+void Archive::commit()
+{
+    std::lock_guard<std::recursive_mutex> write_lock(write_mutex);
+
+    // Take everything that's staged; anything staged from now on goes into the next commit
+    std::vector<PendingFile> files;
+    std::set<std::string> removals;
+    std::set<std::string> hides;
+    unsigned int threads;
+    {
+        std::lock_guard<std::mutex> lock(staging_mutex);
+        files.swap(staged_files);
+        removals.swap(staged_removals);
+        hides.swap(staged_hides);
+        threads = staged_threads;
+        staged_threads = 1;
+
+        for (auto& file : files)
+        {
+            committing.insert(file.name);
+        }
+    }
+
+    if (files.empty() && removals.empty() && hides.empty())
+    {
+        return;
+    }
+
+    std::vector<std::string> order;
+    for (auto& name : diskOrder())
+    {
+        if (removals.find(name) == removals.end() && hides.find(name) == hides.end())
+        {
+            order.push_back(name);
+        }
+    }
+
+    // The staged copies are read from the start every time, so a failed commit can be tried again
+    std::vector<PendingFile> pending = files;
+    for (auto& file : pending)
+    {
+        file.source = file.copy ? bufferSource(file.copy->data()) : fileSource(file.path, file.size);
+    }
+
+    try
+    {
+        rebuild(order, pending, threads, hides);
+    }
+    catch (...)
+    {
+        // Put the changes back in front of anything staged since, which wins if it touches the same file
+        std::lock_guard<std::mutex> lock(staging_mutex);
+        committing.clear();
+
+        std::set<std::string> newer;
+        for (auto& file : staged_files)
+        {
+            newer.insert(file.name);
+        }
+        newer.insert(staged_removals.begin(), staged_removals.end());
+        newer.insert(staged_hides.begin(), staged_hides.end());
+
+        std::vector<PendingFile> restored;
+        for (auto& file : files)
+        {
+            if (newer.find(file.name) == newer.end())
+            {
+                restored.push_back(file);
+            }
+        }
+        staged_files.insert(staged_files.begin(), restored.begin(), restored.end());
+
+        for (auto& name : removals)
+        {
+            if (newer.find(name) == newer.end())
+            {
+                staged_removals.insert(name);
+            }
+        }
+        for (auto& name : hides)
+        {
+            if (newer.find(name) == newer.end())
+            {
+                staged_hides.insert(name);
+            }
+        }
+        staged_threads = std::max(staged_threads, threads);
+
+        throw;
+    }
+
+    std::lock_guard<std::mutex> lock(staging_mutex);
+    committing.clear();
+}
+
+void Archive::commitAsync()
+{
+    std::lock_guard<std::mutex> lock(commit_mutex);
+
+    // Each commit waits for the one before it, so they're written in order
+    // and waitForCommit only has to wait for the last one
+    auto previous = std::make_shared<std::future<void> >(std::move(background_commit));
+    background_commit = std::async(std::launch::async, [this, previous]()
+    {
+        if (previous->valid())
+        {
+            previous->get();
+        }
+        commit();
+    });
+}
+
+void Archive::waitForCommit()
+{
+    std::future<void> running;
+    {
+        std::lock_guard<std::mutex> lock(commit_mutex);
+        running = std::move(background_commit);
+    }
+
+    if (running.valid())
     {
-        // We only need to do it for the compressed one because
-        // compress() allocates memory
-        delete[] data;
-        data = nullptr;
+        running.get();
     }
 }
 
 void Archive::removeFile(const std::string& fname)
 {
+    if (stageRemoval(fname, false))
+    {
+        return;
+    }
+
+    std::lock_guard<std::recursive_mutex> write_lock(write_mutex);
+
     if (database.find(fname) == database.end())
     {
         throw std::invalid_argument("Error: File not in archive");
     }
 
-    database.erase(fname);
+    FileHeader fh = database[fname];
+    fh.removed = true;
+
+    // File headers can only be changed in place if they're in the current format.
+    // Older archives get rebuilt in the new format instead
+    bool upgrade = header.version != FLUX_ARC_VERSION;
+    if (!upgrade)
+    {
+        writeFileHeader(fname, fh);
+    }
+
+    {
+        std::unique_lock<std::shared_mutex> lock(state_mutex);
+        database.erase(fname);
+        tombstones[fname] = fh;
+
+        file_data.erase(fname);
+        decompressed_data.erase(fname);
+    }
+
+    if (upgrade)
+    {
+        rebuild();
+    }
+    else if (getWastedBytes() > compaction_threshold)
+    {
+        if (background_compaction)
+        {
+            compactAsync();
+        }
+        else
+        {
+            compact();
+        }
+    }
+}
+
+void Archive::hideFile(const std::string& fname)
+{
+    if (stageRemoval(fname, true))
+    {
+        return;
+    }
+
+    std::lock_guard<std::recursive_mutex> write_lock(write_mutex);
+
+    if (hidden.find(fname) != hidden.end())
+    {
+        return;
+    }
+
+    {
+        std::unique_lock<std::shared_mutex> lock(state_mutex);
+        hidden.insert(fname);
+
+        if (database.find(fname) != database.end())
+        {
+            database.erase(fname);
+
+            file_data.erase(fname);
+            decompressed_data.erase(fname);
+        }
+    }
+
+    // Hidden files need a new file header, so the whole archive has to be rebuilt
+    rebuild();
+}
+
+uint64_t Archive::getWastedBytes() const
+{
+    std::shared_lock<std::shared_mutex> lock(state_mutex);
+
+    uint64_t wasted = 0;
+    for (auto& it : tombstones)
+    {
+        wasted += fileHeaderSize(it.first) + it.second.file_size_c;
+    }
+
+    return wasted + slack_bytes;
+}
 
+void Archive::compact()
+{
+    // Rebuilding only writes the files that are still in the database
     rebuild();
-}
\ No newline at end of file
+}
+
+void Archive::compactAsync()
+{
+    std::lock_guard<std::mutex> lock(compaction_mutex);
+
+    if (compaction.valid())
+    {
+        if (compaction.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+        {
+            // Removals wait for the running compaction's write lock, so it will include everything removed so far
+            return;
+        }
+        compaction.get();
+    }
+
+    compaction = std::async(std::launch::async, [this]()
+    {
+        compact();
+    });
+}
+
+void Archive::waitForCompaction()
+{
+    std::future<void> running;
+    {
+        std::lock_guard<std::mutex> lock(compaction_mutex);
+        running = std::move(compaction);
+    }
+
+    if (running.valid())
+    {
+        running.get();
+    }
+}
@@ -0,0 +1,176 @@
+#include "FluxArc/Overlay.hh"
+#include <stdexcept>
+#include <algorithm>
+
+using namespace FluxArc;
+
+// About 1% false positives with 10 bits per name and 7 hashes
+static const uint64_t BLOOM_BITS_PER_ITEM = 10;
+static const uint64_t BLOOM_HASHES = 7;
+
+BloomFilter::BloomFilter(size_t expected_items)
+{
+    bit_count = std::max<uint64_t>(64, expected_items * BLOOM_BITS_PER_ITEM);
+    bits = std::vector<uint64_t>((bit_count + 63) / 64, 0);
+}
+
+std::pair<uint64_t, uint64_t> BloomFilter::hash(const std::string& name)
+{
+    // FNV-1a for the second hash, so the two are independent
+    uint64_t second = 14695981039346656037ULL;
+    for (char c : name)
+    {
+        second ^= (uint8_t)c;
+        second *= 1099511628211ULL;
+    }
+
+    // Odd, so the probes don't get stuck on a few bits
+    return std::make_pair((uint64_t)std::hash<std::string>()(name), second | 1);
+}
+
+void BloomFilter::add(const std::pair<uint64_t, uint64_t>& hashes)
+{
+    for (uint64_t i = 0; i < BLOOM_HASHES; i++)
+    {
+        uint64_t bit = (hashes.first + i * hashes.second) % bit_count;
+        bits[bit / 64] |= 1ULL << (bit % 64);
+    }
+}
+
+bool BloomFilter::mightContain(const std::pair<uint64_t, uint64_t>& hashes) const
+{
+    for (uint64_t i = 0; i < BLOOM_HASHES; i++)
+    {
+        uint64_t bit = (hashes.first + i * hashes.second) % bit_count;
+        if ((bits[bit / 64] & (1ULL << (bit % 64))) == 0)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+BloomFilter Overlay::buildFilter(const Archive& archive)
+{
+    auto hidden = archive.getHiddenFiles();
+    BloomFilter filter(archive.getFileCount() + hidden.size());
+
+    archive.forEachFile([&filter](const FileInfo& info)
+    {
+        filter.add(BloomFilter::hash(info.name));
+    });
+
+    for (auto& name : hidden)
+    {
+        filter.add(BloomFilter::hash(name));
+    }
+
+    return filter;
+}
+
+void Overlay::mount(const std::string& filename, bool dynamic)
+{
+    mount(std::make_shared<Archive>(filename, dynamic));
+}
+
+void Overlay::mount(std::shared_ptr<Archive> archive)
+{
+    Layer layer;
+    layer.filter = buildFilter(*archive);
+    layer.archive = archive;
+
+    layers.push_back(layer);
+}
+
+void Overlay::updateFilters()
+{
+    for (auto& layer : layers)
+    {
+        layer.filter = buildFilter(*layer.archive);
+    }
+}
+
+std::shared_ptr<Archive> Overlay::findLayer(const std::string& fname) const
+{
+    auto hashes = BloomFilter::hash(fname);
+
+    // Top layer first
+    for (auto it = layers.rbegin(); it != layers.rend(); it++)
+    {
+        if (!it->filter.mightContain(hashes))
+        {
+            continue;
+        }
+
+        if (it->archive->hasFile(fname))
+        {
+            return it->archive;
+        }
+
+        if (it->archive->isHidden(fname))
+        {
+            return nullptr;
+        }
+    }
+
+    return nullptr;
+}
+
+std::shared_ptr<Archive> Overlay::getLayer(const std::string& fname) const
+{
+    auto layer = findLayer(fname);
+    if (layer == nullptr)
+    {
+        throw std::invalid_argument("Error: File not in archive");
+    }
+
+    return layer;
+}
+
+uint64_t Overlay::getFileSize(const std::string& fname)
+{
+    return getLayer(fname)->getFileSize(fname);
+}
+
+uint64_t Overlay::getFile(const std::string& fname, char* data, bool res_compressed)
+{
+    return getLayer(fname)->getFile(fname, data, res_compressed);
+}
+
+std::string Overlay::getFile(const std::string& fname)
+{
+    return getLayer(fname)->getFile(fname);
+}
+
+BinaryFile Overlay::getBinaryFile(const std::string& fname)
+{
+    return getLayer(fname)->getBinaryFile(fname);
+}
+
+std::vector<FileInfo> Overlay::listFiles(const std::string& prefix) const
+{
+    // Bottom layer first, so the layers above overwrite or hide its files
+    std::map<std::string, FileInfo> merged;
+    for (auto& layer : layers)
+    {
+        for (auto& name : layer.archive->getHiddenFiles())
+        {
+            merged.erase(name);
+        }
+
+        layer.archive->forEachFile([&merged](const FileInfo& info)
+        {
+            merged[info.name] = info;
+        }, prefix);
+    }
+
+    std::vector<FileInfo> output;
+    output.reserve(merged.size());
+    for (auto& it : merged)
+    {
+        output.push_back(it.second);
+    }
+
+    return output;
+}
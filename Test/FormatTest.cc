@@ -0,0 +1,694 @@
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "AsyncFiles/AsyncFiles.hh"
+#include "FluxArc/FluxArc.hh"
+#include "FluxArc/Overlay.hh"
+#include "lz4.h"
+
+/*
+FluxArcFormatTest: checks the parts of the archive format that have changed over time, by writing archives,
+opening them again and reading everything back, and the features built on top of it. Run by ctest; returns 1 if anything failed.
+*/
+
+static int failures = 0;
+
+static void check(bool condition, const std::string& what)
+{
+    if (!condition)
+    {
+        std::cerr << "FAILED: " << what << "\n";
+        failures++;
+    }
+}
+
+/** Gets data that compresses about as well as text, different for every seed */
+static std::string makeData(uint64_t size, int seed)
+{
+    static const char* words[] = {"texture ", "mesh ", "shader ", "vertex ", "0.5f, ", "1.0f, ", "{\"id\": ", "}\n"};
+    std::string output;
+    output.reserve(size);
+
+    uint64_t state = seed * 2654435761u + 1;
+    while (output.size() < size)
+    {
+        state = state * 6364136223846793005ull + 1442695040888963407ull;
+        output += words[(state >> 33) % 8];
+    }
+
+    output.resize(size);
+    return output;
+}
+
+/** Reads a whole file from an Archive or an Overlay */
+template <typename T>
+static std::string readAll(T& archive, const std::string& fname)
+{
+    std::string output(archive.getFileSize(fname), '\0');
+    archive.getFile(fname, &output[0]);
+    return output;
+}
+
+static void removeArchive(const std::string& filename)
+{
+    std::filesystem::remove(filename);
+    for (auto& entry : std::filesystem::directory_iterator("."))
+    {
+        if (entry.path().filename().string().rfind(filename + ".", 0) == 0)
+        {
+            std::filesystem::remove(entry.path());
+        }
+    }
+}
+
+template <typename T>
+static void append(std::string& output, T value)
+{
+    output.append((const char*)&value, sizeof(T));
+}
+
+/** Writes an archive the way the first version of FluxArc did: 32 bit sizes and single LZ4 blocks */
+static void writeVersion1(const std::string& filename, const std::string& plain, const std::string& packed)
+{
+    std::vector<char> compressed(LZ4_compressBound(packed.size()));
+    int compressed_size = LZ4_compress_default(packed.data(), compressed.data(), packed.size(), compressed.size());
+
+    std::string names[] = {"plain", "packed"};
+    uint64_t index_size = 16;
+    for (auto& name : names)
+    {
+        index_size += sizeof(uint32_t) + sizeof(bool) + sizeof(uint64_t) + 2 * sizeof(uint32_t) + name.size();
+    }
+
+    std::string file;
+    append<uint16_t>(file, 5639);
+    append<uint16_t>(file, 1);
+    append<uint64_t>(file, index_size + plain.size() + compressed_size);
+    append<uint32_t>(file, 2);
+
+    append<uint32_t>(file, names[0].size());
+    append<bool>(file, false);
+    append<uint64_t>(file, index_size);
+    append<uint32_t>(file, plain.size());
+    append<uint32_t>(file, plain.size());
+    file += names[0];
+
+    append<uint32_t>(file, names[1].size());
+    append<bool>(file, true);
+    append<uint64_t>(file, index_size + plain.size());
+    append<uint32_t>(file, packed.size());
+    append<uint32_t>(file, compressed_size);
+    file += names[1];
+
+    file += plain;
+    file.append(compressed.data(), compressed_size);
+
+    std::ofstream output(filename, std::ios::binary | std::ios::trunc);
+    output.write(file.data(), file.size());
+}
+
+static void testVersion1Upgrade()
+{
+    std::string filename = "format_v1.farc";
+    removeArchive(filename);
+
+    std::string plain = makeData(1000, 1);
+    std::string packed = makeData(50000, 2);
+    writeVersion1(filename, plain, packed);
+
+    for (bool dynamic : {true, false})
+    {
+        FluxArc::Archive archive(filename, dynamic);
+        check(readAll(archive, "plain") == plain, "v1: uncompressed file");
+        check(readAll(archive, "packed") == packed, "v1: compressed file");
+    }
+
+    // Changing a file in an old archive rebuilds it in the current format
+    {
+        FluxArc::Archive archive(filename, true);
+        archive.removeFile("plain");
+    }
+
+    FluxArc::Archive archive(filename, true);
+    check(!archive.hasFile("plain"), "v1 upgrade: removed file is gone");
+    check(readAll(archive, "packed") == packed, "v1 upgrade: compressed file");
+
+    // Only current archives have checksums
+    auto result = archive.verify(2);
+    check(result.files == 1 && result.broken.empty(), "v1 upgrade: verify");
+
+    removeArchive(filename);
+}
+
+static void testChunkedCompression()
+{
+    std::string filename = "format_chunked.farc";
+    removeArchive(filename);
+
+    // Bigger than a compression chunk, so it's split into several
+    std::string data = makeData(10 * 1024 * 1024 + 123, 3);
+    {
+        FluxArc::Archive archive(filename, true);
+        archive.setFile("big", &data[0], data.size(), true);
+    }
+
+    for (bool dynamic : {true, false})
+    {
+        FluxArc::Archive archive(filename, dynamic);
+        check(archive.listFiles()[0].stored_size < data.size(), "chunked: file is compressed");
+        check(readAll(archive, "big") == data, "chunked: getFile");
+
+        // Odd sized pieces, so reads cross the chunks
+        FluxArc::FileReader reader = archive.openFile("big");
+        std::string streamed;
+        std::vector<char> piece(1000003);
+        while (!reader.isDone())
+        {
+            uint64_t read = reader.read(piece.data(), piece.size());
+            streamed.append(piece.data(), read);
+        }
+        check(streamed == data, "chunked: openFile");
+    }
+
+    removeArchive(filename);
+}
+
+static void testOverwriteInPlace()
+{
+    std::string filename = "format_overwrite.farc";
+    removeArchive(filename);
+
+    std::string first = makeData(20000, 4);
+    std::string other = makeData(5000, 5);
+    std::string second = makeData(15000, 6);
+    uint64_t offset;
+    {
+        FluxArc::Archive archive(filename, true);
+        archive.setFiles({{"first", &first[0], first.size(), true, false}, {"other", &other[0], other.size(), false, false}});
+        offset = archive.getFileOffset("first");
+
+        // Smaller, so it fits where the old version was
+        archive.setFile("first", &second[0], second.size(), true);
+        check(archive.getFileOffset("first") == offset, "overwrite: written in place");
+    }
+
+    for (bool dynamic : {true, false})
+    {
+        FluxArc::Archive archive(filename, dynamic);
+        check(readAll(archive, "first") == second, "overwrite: new data after reopening");
+        check(readAll(archive, "other") == other, "overwrite: other file untouched");
+        check(archive.verify(2).broken.empty(), "overwrite: verify");
+    }
+
+    removeArchive(filename);
+}
+
+static void testVolumes()
+{
+    std::string filename = "format_volumes.farc";
+    removeArchive(filename);
+
+    std::vector<std::string> data;
+    std::vector<FluxArc::NewFile> files;
+    for (int i = 0; i < 40; i++)
+    {
+        data.push_back(makeData(10000 + i * 500, 10 + i));
+    }
+    for (int i = 0; i < 40; i++)
+    {
+        files.push_back({"file" + std::to_string(i), &data[i][0], data[i].size(), i % 2 == 0, false});
+    }
+
+    {
+        FluxArc::Archive archive(filename, true);
+        archive.setFiles(files);
+        archive.setVolumeSize(64 * 1024);
+        archive.rebuild();
+        check(archive.getVolumeCount() > 1, "volumes: archive is split");
+    }
+
+    for (bool dynamic : {true, false})
+    {
+        FluxArc::Archive archive(filename, dynamic);
+        check(archive.getVolumeCount() > 1, "volumes: split after reopening");
+
+        bool all_match = true;
+        for (int i = 0; i < 40; i++)
+        {
+            all_match = all_match && readAll(archive, "file" + std::to_string(i)) == data[i];
+        }
+        check(all_match, "volumes: every file");
+
+        auto result = archive.verify(4);
+        check(result.files == 40 && result.broken.empty(), "volumes: verify");
+    }
+
+    removeArchive(filename);
+}
+
+static void testStagedCommit()
+{
+    std::string filename = "format_staged.farc";
+    removeArchive(filename);
+
+    std::string a = makeData(3000, 7);
+    std::string b = makeData(4000, 8);
+    {
+        FluxArc::Archive archive(filename, true);
+        archive.setFile("a", &a[0], a.size());
+        archive.setFile("gone", &b[0], b.size());
+
+        archive.setAutoCommit(false);
+        archive.setFile("b", &b[0], b.size(), true);
+        archive.removeFile("gone");
+        check(archive.getStagedCount() == 2, "staged: changes are staged");
+        check(!archive.hasFile("b") && archive.hasFile("gone"), "staged: not visible before commit");
+
+        archive.commit();
+        check(archive.getStagedCount() == 0, "staged: nothing left after commit");
+    }
+
+    FluxArc::Archive archive(filename, true);
+    check(readAll(archive, "a") == a, "staged: old file");
+    check(readAll(archive, "b") == b, "staged: committed file");
+    check(!archive.hasFile("gone"), "staged: committed removal");
+
+    removeArchive(filename);
+}
+
+static void testListDirectory()
+{
+    std::string filename = "format_directory.farc";
+    removeArchive(filename);
+
+    FluxArc::Archive archive(filename, true);
+    for (auto name : {"a.txt", "textures/ui/x.png", "textures/ui/w.png", "textures/ui/sub/y.png", "textures/ui/sub/z.png", "textures/ui0", "textures/uj"})
+    {
+        std::string data = name;
+        archive.setFile(name, &data[0], data.size());
+    }
+
+    std::vector<std::string> subdirectories;
+    auto files = archive.listDirectory("textures/ui/", &subdirectories);
+    check(files.size() == 2 && files[0].name == "textures/ui/w.png" && files[1].name == "textures/ui/x.png", "listDirectory: direct files only, in order");
+    check(subdirectories == std::vector<std::string>{"sub"}, "listDirectory: sub-directories");
+    check(archive.listDirectory("textures/ui").size() == 2, "listDirectory: trailing slash is optional");
+
+    auto root = archive.listDirectory("");
+    check(root.size() == 1 && root[0].name == "a.txt", "listDirectory: root");
+
+    removeArchive(filename);
+}
+
+static void testRemoveAndCompact()
+{
+    std::string filename = "format_compact.farc";
+    removeArchive(filename);
+
+    std::vector<std::string> data;
+    std::vector<FluxArc::NewFile> files;
+    for (int i = 0; i < 10; i++)
+    {
+        data.push_back(makeData(4000 + i * 100, 30 + i));
+    }
+    for (int i = 0; i < 10; i++)
+    {
+        files.push_back({"file" + std::to_string(i), &data[i][0], data[i].size(), i % 2 == 0, false});
+    }
+
+    uint64_t size;
+    {
+        FluxArc::Archive archive(filename, true);
+        archive.setFiles(files);
+        size = std::filesystem::file_size(filename);
+
+        // Removing only marks the file as removed, so nothing is rewritten
+        archive.removeFile("file3");
+        check(std::filesystem::file_size(filename) == size, "remove: archive isn't rewritten");
+        check(archive.getWastedBytes() > 0, "remove: data is wasted");
+    }
+
+    {
+        FluxArc::Archive archive(filename, false);
+        check(!archive.hasFile("file3") && archive.getFileCount() == 9, "remove: gone after reopening");
+        check(archive.getWastedBytes() > 0, "remove: wasted bytes after reopening");
+    }
+
+    {
+        FluxArc::Archive archive(filename, true);
+        archive.compact();
+        check(archive.getWastedBytes() == 0, "compact: nothing wasted");
+        check(std::filesystem::file_size(filename) < size, "compact: archive is smaller");
+
+        // Going over the threshold compacts by itself
+        archive.setCompactionThreshold(1);
+        archive.removeFile("file4");
+        check(archive.getWastedBytes() == 0, "compact: threshold");
+
+        archive.setCompactionThreshold(1, true);
+        archive.removeFile("file5");
+        archive.waitForCompaction();
+        check(archive.getWastedBytes() == 0, "compact: background");
+    }
+
+    FluxArc::Archive archive(filename, true);
+    bool all_match = archive.getFileCount() == 7;
+    for (int i = 0; i < 10; i++)
+    {
+        if (i < 3 || i > 5)
+        {
+            all_match = all_match && readAll(archive, "file" + std::to_string(i)) == data[i];
+        }
+    }
+    check(all_match, "compact: other files kept");
+    check(archive.verify(2).broken.empty(), "compact: verify");
+
+    removeArchive(filename);
+}
+
+static void testOverlay()
+{
+    std::string base_name = "format_base.farc";
+    std::string patch_name = "format_patch.farc";
+    removeArchive(base_name);
+    removeArchive(patch_name);
+
+    std::vector<std::string> data;
+    for (int i = 0; i < 4; i++)
+    {
+        data.push_back(makeData(2000 + i, 50 + i));
+    }
+    {
+        FluxArc::Archive base(base_name, true);
+        base.setFiles({{"a", &data[0][0], data[0].size(), false, false}, {"b", &data[1][0], data[1].size(), true, false}, {"c", &data[2][0], data[2].size(), false, false}});
+
+        FluxArc::Archive patch(patch_name, true);
+        patch.setFile("b", &data[3][0], data[3].size(), true);
+        patch.hideFile("c");
+        check(patch.isHidden("c") && !patch.hasFile("c"), "overlay: hidden file");
+    }
+
+    FluxArc::Overlay overlay;
+    overlay.mount(base_name);
+    overlay.mount(patch_name, false);
+
+    check(readAll(overlay, "a") == data[0], "overlay: file from the base");
+    check(readAll(overlay, "b") == data[3], "overlay: patch shadows the base");
+    check(!overlay.hasFile("c") && !overlay.hasFile("missing"), "overlay: patch hides a file");
+
+    auto files = overlay.listFiles();
+    check(files.size() == 2 && files[0].name == "a" && files[1].name == "b", "overlay: listFiles");
+
+    removeArchive(base_name);
+    removeArchive(patch_name);
+}
+
+static void testStats()
+{
+    std::string filename = "format_stats.farc";
+    removeArchive(filename);
+
+    std::string packed = makeData(100000, 60);
+    std::string plain = makeData(500, 61);
+
+    FluxArc::Archive archive(filename, true);
+    archive.setStatsEnabled(true);
+
+    int events[4] = {0, 0, 0, 0};
+    archive.setTraceHook([&](const FluxArc::TraceEvent& event) { events[event.type]++; });
+
+    archive.setFile("packed", &packed[0], packed.size(), true);
+    archive.setFile("plain", &plain[0], plain.size());
+    readAll(archive, "packed");
+    readAll(archive, "plain");
+    readAll(archive, "plain");
+
+    auto stats = archive.getStats();
+    check(stats.rebuilds == 2 && stats.compressions == 1 && stats.compressed_bytes == packed.size(), "stats: writes");
+    check(stats.disk_reads == 3 && stats.memory_reads == 0 && stats.decompressions == 1 && stats.decompressed_bytes == packed.size(), "stats: reads");
+
+    auto counts = archive.getReadCounts();
+    check(counts["packed"] == 1 && counts["plain"] == 2, "stats: read counts");
+
+    check(events[FluxArc::TraceEvent::Read] == 3 && events[FluxArc::TraceEvent::Decompress] == 1, "trace hook: reads");
+    check(events[FluxArc::TraceEvent::Compress] == 1 && events[FluxArc::TraceEvent::Rebuild] == 2, "trace hook: writes");
+
+    // Nothing is counted once they're reset and turned off, but the hook is still called
+    archive.resetStats();
+    check(archive.getStats().disk_reads == 0 && archive.getReadCounts().empty(), "stats: reset");
+    archive.setStatsEnabled(false);
+    readAll(archive, "plain");
+    check(archive.getStats().disk_reads == 0, "stats: disabled");
+    check(events[FluxArc::TraceEvent::Read] == 4, "trace hook: called without stats");
+
+    archive.setTraceHook(nullptr);
+    readAll(archive, "plain");
+    check(events[FluxArc::TraceEvent::Read] == 4, "trace hook: removed");
+
+    removeArchive(filename);
+}
+
+static void testAlignment()
+{
+    std::string filename = "format_aligned.farc";
+    std::string small = makeData(3, 70);
+    std::string plain = makeData(1000, 71);
+    std::string packed = makeData(20000, 72);
+
+    for (uint32_t alignment : {16u, 4096u})
+    {
+        removeArchive(filename);
+        {
+            FluxArc::Archive archive(filename, true);
+            archive.setAlignment(alignment);
+            archive.setFiles({{"small", &small[0], small.size(), false, false}, {"plain", &plain[0], plain.size(), false, false}, {"packed", &packed[0], packed.size(), true, false}});
+            check(archive.getAlignment() == alignment, "alignment: set");
+
+            bool aligned = true;
+            for (auto& file : archive.listFiles())
+            {
+                aligned = aligned && file.offset % alignment == 0 && archive.getFileOffset(file.name) == file.offset;
+            }
+            check(aligned, "alignment: file offsets");
+        }
+
+        // Stored in the archive, and used for data loaded into memory too
+        FluxArc::Archive archive(filename, false, 1);
+        check(archive.getAlignment() == alignment, "alignment: after reopening");
+        auto plain_view = archive.getFileView("plain");
+        auto packed_view = archive.getFileView("packed");
+        check((uintptr_t)plain_view.get() % alignment == 0 && (uintptr_t)packed_view.get() % alignment == 0, "alignment: data in memory");
+        check(std::string(plain_view.get(), plain.size()) == plain && std::string(packed_view.get(), packed.size()) == packed, "alignment: data");
+    }
+
+    bool threw = false;
+    try
+    {
+        FluxArc::Archive archive;
+        archive.setAlignment(3);
+    }
+    catch (const std::invalid_argument&)
+    {
+        threw = true;
+    }
+    check(threw, "alignment: must be a power of 2");
+
+    removeArchive(filename);
+}
+
+static void testRangedReads()
+{
+    std::string filename = "format_ranged.farc";
+    removeArchive(filename);
+
+    std::string first = makeData(3000, 80);
+    std::string second = makeData(7000, 81);
+    FluxArc::Archive archive(filename, true);
+    archive.setFiles({{"first", &first[0], first.size(), false, false}, {"second", &second[0], second.size(), false, false}});
+
+    // A single uncompressed file, read straight out of the archive
+    FluxArc::FileInfo info = archive.listFiles()[1];
+    std::string read(info.stored_size, '\0');
+    uint64_t size;
+    AsyncFiles::FilePromise* promise = AsyncFiles::read(archive.getVolumeFilename(info.volume), info.offset, info.stored_size, &read[0]);
+    promise->get(size);
+    AsyncFiles::close(promise);
+    check(info.name == "second" && size == second.size() && read == second, "ranged read: archive entry");
+
+    // Reads past the end stop at it
+    uint64_t archive_size = std::filesystem::file_size(filename);
+    std::vector<char> tail(100);
+    promise = AsyncFiles::read(filename, archive_size - 10, tail.size(), tail.data());
+    promise->get(size);
+    AsyncFiles::close(promise);
+    check(size == 10, "ranged read: short read at the end");
+
+    // Writing a range leaves the rest of the file alone
+    std::string scratch = "format_ranged.bin";
+    std::string content = makeData(1000, 82);
+    promise = AsyncFiles::writeFrom(scratch, content.data(), content.size());
+    promise->wait();
+    AsyncFiles::close(promise);
+
+    promise = AsyncFiles::writeAt(scratch, 100, "patch", 5);
+    promise->wait();
+    AsyncFiles::close(promise);
+    content.replace(100, 5, "patch");
+
+    std::string back(content.size(), '\0');
+    promise = AsyncFiles::read(scratch, 0, back.size(), &back[0]);
+    promise->get(size);
+    AsyncFiles::close(promise);
+    check(size == content.size() && back == content, "ranged write: rest of the file kept");
+
+    bool threw = false;
+    promise = AsyncFiles::read("format_missing/file", 0, 1, &back[0]);
+    try
+    {
+        promise->get(size);
+    }
+    catch (const std::runtime_error&)
+    {
+        threw = true;
+    }
+    AsyncFiles::close(promise);
+    check(threw, "ranged read: missing file throws");
+
+    std::filesystem::remove(scratch);
+    removeArchive(filename);
+}
+
+static void testMemoryArchive()
+{
+    std::string filename = "format_memory.farc";
+    removeArchive(filename);
+
+    std::string plain = makeData(2000, 90);
+    std::string packed = makeData(30000, 91);
+    {
+        FluxArc::Archive archive(filename, true);
+        archive.setFiles({{"plain", &plain[0], plain.size(), false, false}, {"packed", &packed[0], packed.size(), true, false}});
+    }
+
+    std::ifstream input(filename, std::ios::binary);
+    std::string bytes((std::istreambuf_iterator<char>(input)), std::istreambuf_iterator<char>());
+
+    for (unsigned int threads : {0u, 2u})
+    {
+        // The archive doesn't own the memory here
+        FluxArc::Archive archive(std::shared_ptr<const char>(bytes.data(), [](const char*) {}), bytes.size(), threads);
+        check(readAll(archive, "plain") == plain && readAll(archive, "packed") == packed, "memory: files");
+
+        auto view = archive.getFileView("plain");
+        check(view.get() >= bytes.data() && view.get() < bytes.data() + bytes.size(), "memory: views point into the memory");
+        check(archive.verify(2).broken.empty(), "memory: verify");
+
+        bool threw = false;
+        try
+        {
+            archive.removeFile("plain");
+        }
+        catch (const std::invalid_argument&)
+        {
+            threw = true;
+        }
+        check(threw && archive.hasFile("plain"), "memory: read only");
+    }
+
+    bool threw = false;
+    try
+    {
+        FluxArc::Archive archive(std::shared_ptr<const char>(bytes.data(), [](const char*) {}), bytes.size() / 2);
+    }
+    catch (const std::invalid_argument&)
+    {
+        threw = true;
+    }
+    check(threw, "memory: truncated archive");
+
+    removeArchive(filename);
+}
+
+static void testRefresh()
+{
+    std::string filename = "format_refresh.farc";
+    removeArchive(filename);
+
+    std::string kept = makeData(5000, 100);
+    std::string changed = makeData(6000, 101);
+    std::string replaced = makeData(6000, 102);
+    std::string added = makeData(700, 103);
+    {
+        FluxArc::Archive writer(filename, true);
+        writer.setFiles({{"kept", &kept[0], kept.size(), false, false}, {"changed", &changed[0], changed.size(), false, false}});
+    }
+
+    for (bool dynamic : {false, true})
+    {
+        FluxArc::Archive reader(filename, dynamic);
+        check(!reader.refresh(), "refresh: nothing changed");
+        auto kept_view = reader.getFileView("kept");
+
+        // Another archive (standing in for another process) overwrites a file in place
+        {
+            FluxArc::Archive writer(filename, true);
+            writer.setFile("changed", &replaced[0], replaced.size());
+        }
+
+        check(reader.refresh(), "refresh: sees an in-place change");
+        check(!reader.refresh(), "refresh: only once");
+        check(readAll(reader, "changed") == replaced && readAll(reader, "kept") == kept, "refresh: in-place change");
+        if (!dynamic)
+        {
+            check(reader.getFileView("kept").get() == kept_view.get(), "refresh: unchanged file isn't loaded again");
+        }
+
+        // Then rebuilds it with a new file
+        {
+            FluxArc::Archive writer(filename, true);
+            writer.setFile("added", &added[0], added.size(), true);
+        }
+
+        check(reader.refresh(), "refresh: sees a rebuild");
+        check(readAll(reader, "added") == added && readAll(reader, "changed") == replaced && readAll(reader, "kept") == kept, "refresh: rebuild");
+
+        // Put it back for the next round
+        FluxArc::Archive writer(filename, true);
+        writer.setFile("changed", &changed[0], changed.size());
+        writer.removeFile("added");
+    }
+
+    removeArchive(filename);
+}
+
+int main()
+{
+    testVersion1Upgrade();
+    testChunkedCompression();
+    testOverwriteInPlace();
+    testVolumes();
+    testStagedCommit();
+    testListDirectory();
+    testRemoveAndCompact();
+    testOverlay();
+    testStats();
+    testAlignment();
+    testRangedReads();
+    testMemoryArchive();
+    testRefresh();
+
+    if (failures > 0)
+    {
+        std::cerr << failures << " checks failed\n";
+        return 1;
+    }
+
+    std::cout << "All checks passed\n";
+    return 0;
+}
@@ -0,0 +1,329 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "FluxArc/FluxArc.hh"
+
+/*
+farc: builds and extracts .farc archives.
+
+Usage: farc pack <directory> <archive> [--compress] [--release] [--threads N] [--volume-size BYTES]
+       farc unpack <archive> <directory> [--threads N]
+       farc list <archive>
+       farc verify <archive> [--threads N]
+*/
+
+using Clock = std::chrono::steady_clock;
+
+struct Options
+{
+    bool compress = false;
+    bool release = false;
+    unsigned int threads = std::max(1u, std::thread::hardware_concurrency());
+    uint64_t volume_size = 0;
+};
+
+static double secondsSince(Clock::time_point start)
+{
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+static void printThroughput(const std::string& action, uint64_t files, uint64_t bytes, double seconds)
+{
+    std::cerr << action << " " << files << " files (" << bytes << " bytes) in " << seconds << "s, "
+              << (bytes / (1024.0 * 1024.0)) / std::max(seconds, 1e-9) << " MB/s\n";
+}
+
+/** Checks if a file name is one of the archive's volumes, <archive>.v<volume>.<generation> */
+static bool isVolumeName(const std::string& name, const std::string& archive_name)
+{
+    std::string prefix = archive_name + ".v";
+    if (name.compare(0, prefix.size(), prefix) != 0)
+    {
+        return false;
+    }
+
+    auto isNumber = [](const std::string& text)
+    {
+        return !text.empty() && std::all_of(text.begin(), text.end(), [](char c) { return c >= '0' && c <= '9'; });
+    };
+
+    std::string rest = name.substr(prefix.size());
+    size_t dot = rest.find('.');
+    return dot != std::string::npos && isNumber(rest.substr(0, dot)) && isNumber(rest.substr(dot + 1));
+}
+
+/** Deletes volumes the archive doesn't use (any more), like ones left over from an archive with more volumes */
+static void removeStaleVolumes(const FluxArc::Archive& archive, const std::string& filename)
+{
+    std::set<std::filesystem::path> used;
+    for (uint32_t i = 1; i < archive.getVolumeCount(); i++)
+    {
+        used.insert(std::filesystem::path(archive.getVolumeFilename(i)).filename());
+    }
+
+    std::filesystem::path path(filename);
+    std::filesystem::path directory = path.parent_path().empty() ? "." : path.parent_path();
+    for (auto& entry : std::filesystem::directory_iterator(directory))
+    {
+        auto name = entry.path().filename();
+        if (isVolumeName(name.string(), path.filename().string()) && used.find(name) == used.end())
+        {
+            std::filesystem::remove(entry.path());
+        }
+    }
+}
+
+static int pack(const std::string& directory, const std::string& filename, const Options& options)
+{
+    auto start = Clock::now();
+
+    // The archive (and its volumes and temporary files) could be inside the directory, and mustn't pack itself
+    std::filesystem::path output = std::filesystem::weakly_canonical(filename);
+    std::string output_name = output.filename().string();
+    auto isOutput = [&](const std::filesystem::path& path)
+    {
+        std::string name = path.filename().string();
+        if (name.compare(0, output_name.size(), output_name) != 0)
+        {
+            return false;
+        }
+
+        std::filesystem::path full = std::filesystem::weakly_canonical(path);
+        return full == output || (full.parent_path() == output.parent_path() && name.compare(0, output_name.size() + 1, output_name + ".") == 0);
+    };
+
+    // Names are relative to the directory, with '/' on every platform
+    std::vector<FluxArc::NewFile> files;
+    std::set<std::string> names;
+    uint64_t total = 0;
+    for (auto& entry : std::filesystem::recursive_directory_iterator(directory))
+    {
+        if (!entry.is_regular_file() || isOutput(entry.path()))
+        {
+            continue;
+        }
+
+        FluxArc::NewFile file;
+        file.name = std::filesystem::relative(entry.path(), directory).generic_string();
+        file.data = nullptr;
+        file.path = entry.path().string();
+        file.size = entry.file_size();
+        file.compressed = options.compress;
+        file.compress_release = options.release;
+        files.push_back(file);
+        names.insert(file.name);
+
+        total += file.size;
+    }
+
+    // Same order every time, so packing the same tree gives the same archive
+    std::sort(files.begin(), files.end(), [](const FluxArc::NewFile& a, const FluxArc::NewFile& b)
+    {
+        return a.name < b.name;
+    });
+
+    // An existing archive is replaced by a single commit, so it's only swapped out once the new one is complete.
+    // One that can't be opened isn't worth keeping
+    std::unique_ptr<FluxArc::Archive> archive;
+    try
+    {
+        archive.reset(new FluxArc::Archive(filename, true));
+    }
+    catch (...)
+    {
+        std::filesystem::remove(filename);
+        archive.reset(new FluxArc::Archive(filename, true));
+    }
+
+    archive->setAutoCommit(false);
+    for (auto& info : archive->listFiles())
+    {
+        if (names.find(info.name) == names.end())
+        {
+            archive->removeFile(info.name);
+        }
+    }
+
+    archive->setVolumeSize(options.volume_size);
+    archive->setFiles(files, options.threads);
+
+    // With nothing to commit, the archive still has to be written (or re-written with the new volume size)
+    if (archive->getStagedCount() == 0)
+    {
+        archive->rebuild();
+    }
+    else
+    {
+        archive->commit();
+    }
+
+    removeStaleVolumes(*archive, filename);
+
+    printThroughput("Packed", files.size(), total, secondsSince(start));
+    return 0;
+}
+
+static int unpack(const std::string& filename, const std::string& directory, const Options& options)
+{
+    auto start = Clock::now();
+    FluxArc::Archive archive(filename, true);
+    auto files = archive.listFiles();
+
+    // Don't let a name write outside the directory
+    for (auto& file : files)
+    {
+        std::filesystem::path path(file.name);
+        if (path.is_absolute() || std::find(path.begin(), path.end(), "..") != path.end())
+        {
+            std::cerr << "Error: Unsafe file name " << file.name << "\n";
+            return 1;
+        }
+    }
+
+    // Directories first, so the threads don't race to create them
+    for (auto& file : files)
+    {
+        std::filesystem::create_directories((std::filesystem::path(directory) / file.name).parent_path());
+    }
+
+    // A file that fails is reported, and the rest are still unpacked
+    std::atomic<uint64_t> failed(0);
+    std::mutex error_mutex;
+    FluxArc::parallelFor(files.size(), options.threads, [&](size_t i)
+    {
+        try
+        {
+            std::ofstream output(std::filesystem::path(directory) / files[i].name, std::ios::out | std::ios::binary | std::ios::trunc);
+            if (!output)
+            {
+                throw std::runtime_error("Error: Could not write " + files[i].name);
+            }
+
+            archive.readFile(files[i].name, [&output](const char* data, uint64_t size)
+            {
+                output.write(data, size);
+                return (bool)output;
+            });
+
+            if (!output)
+            {
+                throw std::runtime_error("Error: Could not write " + files[i].name);
+            }
+        }
+        catch (const std::exception& e)
+        {
+            std::lock_guard<std::mutex> lock(error_mutex);
+            std::cerr << e.what() << "\n";
+            failed++;
+        }
+    });
+
+    uint64_t total = 0;
+    for (auto& file : files)
+    {
+        total += file.size;
+    }
+
+    printThroughput("Unpacked", files.size(), total, secondsSince(start));
+    return failed > 0 ? 1 : 0;
+}
+
+static int list(const std::string& filename)
+{
+    FluxArc::Archive archive(filename, true);
+    archive.forEachFile([](const FluxArc::FileInfo& info)
+    {
+        std::cout << info.size << "\t" << info.stored_size << "\t" << (info.compressed ? "lz4" : "-") << "\t" << info.name << "\n";
+    });
+
+    return 0;
+}
+
+static int verify(const std::string& filename, const Options& options)
+{
+    FluxArc::Archive archive(filename, true);
+    auto result = archive.verify(options.threads);
+
+    for (auto& name : result.broken)
+    {
+        std::cerr << "Error: " << name << " doesn't match its checksum\n";
+    }
+
+    std::cerr << "Verified " << result.files << " files (" << result.bytes << " bytes) in " << result.seconds << "s, "
+              << result.gigabytes_per_second << " GB/s\n";
+    if (!result.broken.empty())
+    {
+        std::cerr << result.broken.size() << " files are broken\n";
+        return 1;
+    }
+
+    return 0;
+}
+
+static void usage()
+{
+    std::cerr << "Usage: farc pack <directory> <archive> [--compress] [--release] [--threads N] [--volume-size BYTES]\n"
+              << "       farc unpack <archive> <directory> [--threads N]\n"
+              << "       farc list <archive>\n"
+              << "       farc verify <archive> [--threads N]\n";
+}
+
+int main(int argc, char** argv)
+{
+    std::vector<std::string> args;
+    Options options;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+
+        if (arg == "--compress") options.compress = true;
+        else if (arg == "--release") options.compress = options.release = true;
+        else if ((arg == "--threads" || arg == "--volume-size") && i + 1 < argc)
+        {
+            std::string value = argv[++i];
+            try
+            {
+                if (arg == "--threads") options.threads = std::max(1, std::stoi(value));
+                else options.volume_size = std::stoull(value);
+            }
+            catch (const std::exception&)
+            {
+                std::cerr << "Invalid value " << value << " for " << arg << "\n";
+                usage();
+                return 1;
+            }
+        }
+        else if (arg.compare(0, 2, "--") == 0)
+        {
+            std::cerr << "Unknown option " << arg << "\n";
+            usage();
+            return 1;
+        }
+        else args.push_back(arg);
+    }
+
+    try
+    {
+        if (args.size() == 3 && args[0] == "pack") return pack(args[1], args[2], options);
+        if (args.size() == 3 && args[0] == "unpack") return unpack(args[1], args[2], options);
+        if (args.size() == 2 && args[0] == "list") return list(args[1]);
+        if (args.size() == 2 && args[0] == "verify") return verify(args[1], options);
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << e.what() << "\n";
+        return 1;
+    }
+
+    usage();
+    return 1;
+}